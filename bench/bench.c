@@ -0,0 +1,484 @@
+// bench.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "termpriv.h"
+
+#include "win.h"
+
+#include <time.h>
+#include <getopt.h>
+#include <locale.h>
+
+/*
+ * Benchmarks of the terminal core, run without a window (see stubs.c).
+ *
+ *   bench gen KIND LINES >FILE   make up LINES lines of output
+ *   bench [OPTION]... write FILE  time feeding FILE to the terminal
+ *   bench [OPTION]... scrollback FILE  the same, keeping all the lines
+ *     in the scrollback, then time reading them back
+ *   bench [OPTION]... lines FILE  time compressing and decompressing
+ *     the lines that FILE leaves in the scrollback
+ *   bench [OPTION]... jump FILE  time jumps to random places in the
+ *     scrollback, up to the end of painting the screen, and separately
+ *     the decoding of the rows by itself
+ *
+ * FILE can also be the recorded output of a real program, for example
+ * from script(1). It is fed to term_write() in chunks, the way output from
+ * the child process would be. The kinds of made-up output are:
+ *   build  a build log, with a coloured compiler warning here and there
+ *   esc    full screen redraws, as from top or an editor: cursor moves,
+ *          colours, erasing and window titles, with little text
+ *   mixed  a shell session: prompts, coloured file listings and text
+ *   cjk    Chinese text mixed with ASCII, and some combining accents
+ *   sgr    text with different colours and attributes for every word
+ */
+
+static const char usage[] =
+  "Usage: bench gen KIND LINES\n"
+  "       bench [OPTION]... COMMAND FILE\n"
+  "\n"
+  "Commands:\n"
+  "  write       feed FILE to the terminal and report MB/s\n"
+  "  scrollback  the same, keeping all lines, and report the memory they\n"
+  "              take and how fast they are fetched back\n"
+  "  lines       compress and decompress the lines FILE leaves in the\n"
+  "              scrollback, and report lines/s and bytes per line\n"
+  "  jump        jump to random places in the scrollback left by FILE, and\n"
+  "              report the time to the first painted frame\n"
+  "\n"
+  "Options:\n"
+  "  -r ROWS     screen rows (default 50)\n"
+  "  -c COLS     screen columns (default 160)\n"
+  "  -s LINES    scrollback lines (default 0, or 10000000 for scrollback,\n"
+  "              lines and jump)\n"
+  "  -S KB       scrollback size limit (default 0, no limit)\n"
+  "  -f          spill the scrollback to a file\n"
+  "  -b BYTES    bytes per term_write() call (default 4096)\n"
+  "  -n RUNS     number of runs, of which the best is reported (default 3)\n"
+  "  -j JUMPS    number of jumps (default 200)\n";
+
+static int rows = 50, cols = 160, chunk = 4096, runs = 3, jumps = 200;
+
+static char *input;
+static uint input_len;
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Made-up output. The random numbers are always the same, so that runs
+ * can be compared.
+ */
+
+static uint seed = 1;
+
+static uint
+rnd(uint n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % n;
+}
+
+static string
+pick(string *words, uint n)
+{ return words[rnd(n)]; }
+
+static string dirs[] = {
+  "core", "net", "fs", "drivers/usb", "drivers/gpu", "lib", "ui", "util",
+  "crypto", "sound", "mm", "kernel"
+};
+static string names[] = {
+  "buffer", "parser", "main", "config", "socket", "table", "render",
+  "stream", "cache", "thread", "screen", "string", "memory", "device"
+};
+
+static void
+gen_build(void)
+{
+  string dir = pick(dirs, lengthof(dirs));
+  string name = pick(names, lengthof(names));
+  switch (rnd(20)) {
+    when 0:
+      printf("\e[01m\e[K%s/%s.c:%u:%u:\e[m\e[K \e[01;35m\e[Kwarning: "
+             "\e[m\e[Kunused variable '\e[01m\e[K%s%u\e[m\e[K' "
+             "[\e[01;35m\e[K-Wunused-variable\e[m\e[K]\r\n",
+             dir, name, rnd(2000) + 1, rnd(40) + 1, name, rnd(10));
+    when 1 or 2 or 3:
+      printf("gcc -c -O2 -g -Wall -Wextra -Iinclude -I%s -DHAVE_CONFIG_H "
+             "-o obj/%s/%s.o %s/%s.c\r\n", dir, dir, name, dir, name);
+    otherwise:
+      printf("  CC      %s/%s_%s.o\r\n",
+             dir, name, pick(names, lengthof(names)));
+  }
+}
+
+static void
+gen_esc(void)
+{
+  // Each "line" redraws a row of a 50 row screen, every 50th also the
+  // title and the status line.
+  static uint row;
+  row = row % 50 + 1;
+  if (row == 1)
+    printf("\e]0;top - %u users, load %u.%02u\a\e[H\e[1;7m%-40s\e[m\e[K",
+           rnd(10), rnd(8), rnd(100), pick(names, lengthof(names)));
+  printf("\e[%u;1H\e[38;5;%um%5u \e[1m%-8s\e[22m", row, rnd(256), rnd(65536),
+         pick(dirs, lengthof(dirs)));
+  for (uint i = rnd(6); i; i--)
+    printf("\e[3%u;4%um%3u.%u\e[39;49m ", rnd(8), rnd(8), rnd(100), rnd(10));
+  printf("\e[K\e7\e[%u;%uH\e[0;2m%s\e8", rnd(50) + 1, rnd(120) + 1,
+         pick(names, lengthof(names)));
+}
+
+static string words[] = {
+  "the", "of", "and", "a", "to", "in", "is", "you", "that", "it", "file",
+  "was", "for", "on", "are", "with", "as", "this", "be", "at", "have",
+  "from", "or", "by", "one", "had", "not", "but", "what", "all", "were"
+};
+
+/* A few words of text, taking up about len columns. */
+static void
+gen_words(uint len)
+{
+  for (uint n = 0; n < len;) {
+    string word = pick(words, lengthof(words));
+    n += printf(n ? " %s" : "%s", word);
+  }
+}
+
+static void
+gen_mixed(void)
+{
+  switch (rnd(10)) {
+    when 0:
+      printf("\e[1;32muser@host\e[m:\e[1;34m~/src/%s\e[m$ ls -l\r\n",
+             pick(dirs, lengthof(dirs)));
+    when 1 or 2 or 3: {
+      // ls --color
+      static string colours[] = {"0", "01;34", "01;32", "01;36", "01;31"};
+      printf("-rw-r--r-- 1 user user %7u Oct %2u %02u:%02u ",
+             rnd(1000000), rnd(31) + 1, rnd(24), rnd(60));
+      printf("\e[%sm%s_%s\e[0m\r\n", pick(colours, lengthof(colours)),
+             pick(names, lengthof(names)), pick(names, lengthof(names)));
+    }
+    when 4:
+      printf("\r\n");
+    otherwise:
+      gen_words(rnd(100));
+      printf("\r\n");
+  }
+}
+
+static void
+gen_cjk(void)
+{
+  for (uint n = rnd(70); n--;) {
+    uint r = rnd(20);
+    if (r == 0)
+      printf(" ");
+    else if (r < 4)
+      printf("%s", pick(words, lengthof(words)));
+    else if (r == 4)
+      printf("e\xCC\x81");
+    else {
+      uint c = 0x4E00 + rnd(0x5200);
+      printf("%c%c%c",
+             0xE0 | c >> 12, 0x80 | (c >> 6 & 0x3F), 0x80 | (c & 0x3F));
+    }
+  }
+  printf("\r\n");
+}
+
+static void
+gen_sgr(void)
+{
+  for (uint n = rnd(20); n--;) {
+    switch (rnd(4)) {
+      when 0: printf("\e[1;3%um", rnd(8));
+      when 1: printf("\e[38;5;%u;48;5;%um", rnd(256), rnd(256));
+      when 2: printf("\e[4;7m");
+      when 3: printf("\e[0m");
+    }
+    printf("%s ", pick(words, lengthof(words)));
+  }
+  printf("\e[0m\r\n");
+}
+
+static int
+gen(string kind, int lines)
+{
+  void (*gen_line)(void) =
+    !strcmp(kind, "build") ? gen_build :
+    !strcmp(kind, "esc") ? gen_esc :
+    !strcmp(kind, "mixed") ? gen_mixed :
+    !strcmp(kind, "cjk") ? gen_cjk :
+    !strcmp(kind, "sgr") ? gen_sgr :
+    null;
+  if (!gen_line) {
+    fprintf(stderr, "bench: unknown kind of output '%s'\n", kind);
+    return 1;
+  }
+  while (lines--)
+    gen_line();
+  return 0;
+}
+
+static bool
+read_input(string path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  uint size = 0;
+  for (;;) {
+    input = renewn(input, size += 1 << 20);
+    input_len += fread(input + input_len, 1, size - input_len, f);
+    if (input_len < size)
+      break;
+  }
+  fclose(f);
+  return true;
+}
+
+/* Start a run with a freshly reset terminal of the chosen size. */
+static void
+start_run(void)
+{
+  term_reset();
+  term_clear_scrollback();
+  term_resize(rows, cols);
+}
+
+static void
+feed(void)
+{
+  for (uint pos = 0; pos < input_len; pos += chunk)
+    term_write(input + pos, min((uint)chunk, input_len - pos));
+}
+
+/* Resident memory in bytes, from /proc. */
+static long long
+resident(void)
+{
+  long long size = 0, res = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%lld %lld", &size, &res) != 2)
+      res = 0;
+    fclose(f);
+  }
+  return res * getpagesize();
+}
+
+static void
+bench_write(void)
+{
+  double best = 0;
+  for (int i = 0; i < runs; i++) {
+    start_run();
+    double t = now();
+    feed();
+    t = now() - t;
+    if (!i || t < best)
+      best = t;
+  }
+  printf("write: %.1f MB in %.3f s, %.1f MB/s\n",
+         input_len / 1e6, best, input_len / 1e6 / best);
+}
+
+static void
+bench_scrollback(void)
+{
+  if (!cfg.scrollback_lines)
+    cfg.scrollback_lines = new_cfg.scrollback_lines = 10000000;
+
+  double best_push = 0, best_fetch = 0;
+  long long memory = 0, stored = 0, filed = 0;
+  int lines = 0;
+  for (int i = 0; i < runs; i++) {
+    start_run();
+    long long res = resident();
+    double t = now();
+    feed();
+    t = now() - t;
+    if (!i) {
+      memory = resident() - res;
+      scrollback_usage(&stored, &filed);
+    }
+    if (!i || t < best_push)
+      best_push = t;
+
+    // Read the lines back from the oldest to the newest.
+    lines = sblines();
+    t = now();
+    for (int y = -lines; y < 0; y++)
+      release_line(fetch_line(y));
+    t = now() - t;
+    if (!i || t < best_fetch)
+      best_fetch = t;
+  }
+  printf("push: %.1f MB in %.3f s, %.1f MB/s\n",
+         input_len / 1e6, best_push, input_len / 1e6 / best_push);
+  printf("scrollback: %d lines, %.1f MB resident\n", lines, memory / 1e6);
+  printf("storage: %lld bytes in memory, %lld in the file\n", stored, filed);
+  printf("fetch: %d lines in %.3f s, %.0fk lines/s\n",
+         lines, best_fetch, lines / 1e3 / best_fetch);
+}
+
+static void
+bench_lines(void)
+{
+  if (!cfg.scrollback_lines)
+    cfg.scrollback_lines = new_cfg.scrollback_lines = 10000000;
+  start_run();
+  feed();
+
+  // Take copies of the lines at full width, as they are when they are
+  // pushed, and keep them compressed too.
+  int lines = sblines();
+  termline **copies = newn(termline *, max(lines, 1));
+  uint *ends = newn(uint, max(lines, 1));
+  uchar *buf = null, *data = null;
+  uint bufsize = 0, used = 0;
+  for (int i = 0; i < lines; i++) {
+    termline *line = fetch_line(i - lines);
+    uint len = compressline(line, &buf, &bufsize);
+    release_line(line);
+    data = renewn(data, used + len);
+    memcpy(data + used, buf, len);
+    ends[i] = used += len;
+    copies[i] = decompressline(buf, null);
+    resizeline(copies[i], term.cols);
+  }
+
+  double best_compress = 0, best_decompress = 0;
+  for (int r = 0; r < runs; r++) {
+    double t = now();
+    for (int i = 0; i < lines; i++)
+      compressline(copies[i], &buf, &bufsize);
+    t = now() - t;
+    if (!r || t < best_compress)
+      best_compress = t;
+
+    t = now();
+    for (int i = 0; i < lines; i++)
+      freeline(decompressline(data + (i ? ends[i - 1] : 0), null));
+    t = now() - t;
+    if (!r || t < best_decompress)
+      best_decompress = t;
+  }
+  printf("lines: %d, %.1f bytes per line\n", lines, (double)used / max(lines, 1));
+  printf("compress: %.0fk lines/s\n", lines / 1e3 / best_compress);
+  printf("decompress: %.0fk lines/s\n", lines / 1e3 / best_decompress);
+
+  for (int i = 0; i < lines; i++)
+    freeline(copies[i]);
+  free(copies);
+  free(ends);
+  free(buf);
+  free(data);
+}
+
+static void
+bench_jump(void)
+{
+  if (!cfg.scrollback_lines)
+    cfg.scrollback_lines = new_cfg.scrollback_lines = 10000000;
+  start_run();
+  feed();
+  term_paint();
+
+  int lines = sblines();
+  if (lines <= term.rows) {
+    fputs("bench: not enough scrollback to jump around in\n", stderr);
+    return;
+  }
+  double total = 0, worst = 0;
+  for (int i = 0; i < jumps; i++) {
+    int top = rnd(lines - term.rows);
+    double t = now();
+    term_scroll(1, top);
+    term_paint();
+    t = now() - t;
+    total += t;
+    worst = max(worst, t);
+  }
+  printf("jump: %d jumps over %d lines in a %dx%d terminal\n",
+         jumps, lines, term.rows, term.cols);
+  printf("first frame: %.3f ms average, %.3f ms worst\n",
+         total / jumps * 1e3, worst * 1e3);
+
+  // Fetch the rows of other jumps one by one, without painting.
+  total = 0;
+  for (int i = 0; i < jumps; i++) {
+    int top = rnd(lines - term.rows) - lines;
+    double t = now();
+    for (int y = top; y < top + term.rows; y++)
+      release_line(fetch_line(y));
+    total += now() - t;
+  }
+  printf("decoding the rows one by one: %.3f ms average\n",
+         total / jumps * 1e3);
+}
+
+int
+main(int argc, char *argv[])
+{
+  // Where there is locale support, character widths come from wcwidth().
+  setlocale(LC_CTYPE, "C.UTF-8");
+
+  cfg = (config){
+    .fg_colour = 0xBFBFBF, .bg_colour = 0x000000, .cursor_colour = 0xBFBFBF,
+    .font = {.name = "Lucida Console", .size = 9},
+    .bold_as_colour = true,
+    .term = "xterm", .answerback = "", .printer = "", .word_chars = ""
+  };
+
+  if (argc == 4 && !strcmp(argv[1], "gen"))
+    return gen(argv[2], atoi(argv[3]));
+
+  for (int opt; (opt = getopt(argc, argv, "r:c:s:S:fb:n:j:")) != -1;) {
+    switch (opt) {
+      when 'r': rows = atoi(optarg);
+      when 'c': cols = atoi(optarg);
+      when 's': cfg.scrollback_lines = atoi(optarg);
+      when 'S': cfg.scrollback_size = atoi(optarg);
+      when 'f': cfg.scrollback_file = true;
+      when 'b': chunk = atoi(optarg);
+      when 'n': runs = atoi(optarg);
+      when 'j': jumps = atoi(optarg);
+      otherwise:
+        fputs(usage, stderr);
+        return 1;
+    }
+  }
+  if (argc - optind != 2 || rows < 1 || cols < 1 || chunk < 1 || runs < 1 ||
+      jumps < 1) {
+    fputs(usage, stderr);
+    return 1;
+  }
+  new_cfg = cfg;
+
+  string cmd = argv[optind];
+  void (*run)(void) =
+    !strcmp(cmd, "write") ? bench_write :
+    !strcmp(cmd, "scrollback") ? bench_scrollback :
+    !strcmp(cmd, "lines") ? bench_lines :
+    !strcmp(cmd, "jump") ? bench_jump :
+    null;
+  if (!run) {
+    fputs(usage, stderr);
+    return 1;
+  }
+  if (!read_input(argv[optind + 1]))
+    return 1;
+  run();
+  return 0;
+}
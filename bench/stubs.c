@@ -0,0 +1,178 @@
+// stubs.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "term.h"
+#include "win.h"
+#include "charset.h"
+#include "child.h"
+#include "print.h"
+
+#include <time.h>
+
+/*
+ * Stand-ins for the window, child process, printer and charset code, so
+ * that the terminal core can be run without a window by the benchmarks.
+ * Painting goes nowhere, replies to the child are dropped, and the
+ * charset is always UTF-8.
+ */
+
+config cfg, new_cfg;
+
+wchar win_linedraw_chars[31] = {
+  0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0, 0x00B1,
+  0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C, 0x23BA,
+  0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534, 0x252C,
+  0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7
+};
+
+void win_reconfig(void) {}
+void win_update(void) {}
+void win_schedule_update(void) {}
+
+void
+win_text(int unused(x), int unused(y), wchar *unused(text), int unused(len),
+         uint unused(attr), int unused(lattr))
+{}
+
+bool win_scroll(int unused(top), int unused(bot), int unused(lines))
+{ return true; }
+
+void win_update_mouse(void) {}
+void win_capture_mouse(void) {}
+void win_bell(void) {}
+
+void win_set_title(char *unused(title)) {}
+void win_save_title(void) {}
+void win_restore_title(void) {}
+
+colour win_get_colour(colour_i unused(i)) { return 0; }
+void win_set_colour(colour_i unused(i), colour unused(c)) {}
+void win_reset_colours(void) {}
+colour win_get_sys_colour(bool fg) { return fg ? 0xFFFFFF : 0; }
+
+void win_invalidate_all(void) {}
+
+void win_set_pos(int unused(x), int unused(y)) {}
+void win_set_chars(int unused(rows), int unused(cols)) {}
+void win_set_pixels(int unused(height), int unused(width)) {}
+void win_maximise(int unused(max)) {}
+void win_set_zorder(bool unused(top)) {}
+void win_set_iconic(bool unused(iconic)) {}
+void win_update_scrollbar(void) {}
+bool win_is_iconic(void) { return false; }
+void win_get_pos(int *xp, int *yp) { *xp = *yp = 0; }
+void win_get_pixels(int *height_p, int *width_p) { *height_p = *width_p = 0; }
+void win_get_screen_chars(int *rows_p, int *cols_p)
+{ *rows_p = term.rows; *cols_p = term.cols; }
+void win_popup_menu(void) {}
+
+void win_zoom_font(int unused(zoom)) {}
+void win_set_font_size(int unused(size)) {}
+uint win_get_font_size(void) { return cfg.font.size; }
+
+void win_check_glyphs(wchar *unused(wcs), uint unused(num)) {}
+
+void win_open(wstring path) { free((wchar *)path); }
+void win_copy(const wchar *unused(data), uint *unused(attrs), int unused(len)) {}
+void win_paste(void) {}
+
+void win_set_timer(void_fn unused(cb), uint unused(ticks)) {}
+
+void win_show_about(void) {}
+void win_show_error(wchar *unused(msg)) {}
+void win_show_progress(int unused(percent)) {}
+
+bool win_is_glass_available(void) { return false; }
+
+int
+get_tick_count(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int cursor_blink_ticks(void) { return 500; }
+
+int win_char_width(xchar unused(c)) { return 1; }
+wchar win_combine_chars(wchar unused(bc), wchar unused(cc)) { return 0; }
+
+void child_write(const char *unused(buf), uint unused(len)) {}
+void child_printf(const char *unused(fmt), ...) {}
+void child_sendw(const wchar *unused(ws), uint unused(len)) {}
+
+void printer_start_job(string unused(printer_name)) {}
+void printer_write(void *unused(buf), uint unused(len)) {}
+void printer_finish_job(void) {}
+
+bool parse_colour(string unused(s), colour *unused(cp)) { return false; }
+
+bool font_ambig_wide;
+int cs_cur_max = 4;
+bool cs_ascii_compatible = true;
+bool cs_utf8 = true;
+
+void cs_set_mode(cs_mode unused(mode)) {}
+string cs_get_locale(void) { return "C.UTF-8"; }
+void cs_set_locale(string unused(locale)) {}
+wchar cs_btowc_glyph(char c) { return (uchar)c; }
+int cs_mbstowcs(wchar *unused(ws), const char *unused(s), size_t unused(wlen))
+{ return 0; }
+
+/*
+ * Decode UTF-8 a byte at a time the way the Windows conversion does,
+ * giving characters outside the BMP as surrogate pairs.
+ */
+int
+cs_mb1towc(wchar *pwc, char c)
+{
+  static uint need, have, code;
+  static bool low_pending;
+  uchar b = c;
+  if (!pwc) {
+    need = 0;
+    low_pending = false;
+    return 0;
+  }
+  if (low_pending) {
+    *pwc = 0xDC00 | (code & 0x3FF);
+    low_pending = false;
+    return 1;
+  }
+  if (!need) {
+    if (b < 0x80) {
+      *pwc = b;
+      return 1;
+    }
+    if (b >= 0xC2 && b < 0xE0)
+      need = 1, code = b & 0x1F;
+    else if (b >= 0xE0 && b < 0xF0)
+      need = 2, code = b & 0x0F;
+    else if (b >= 0xF0 && b < 0xF5)
+      need = 3, code = b & 0x07;
+    else
+      return -1;
+    have = 0;
+    return -2;
+  }
+  if ((b & 0xC0) != 0x80) {
+    need = 0;
+    return -1;
+  }
+  code = code << 6 | (b & 0x3F);
+  if (++have < need)
+    return -2;
+  uint n = need;
+  need = 0;
+  if ((n == 2 && code < 0x800) || (n == 3 && code < 0x10000) ||
+      code > 0x10FFFF || (code >= 0xD800 && code < 0xE000))
+    return -1;
+  if (code >= 0x10000) {
+    code -= 0x10000;
+    *pwc = 0xD800 | code >> 10;
+    low_pending = true;
+    return 0;
+  }
+  *pwc = code;
+  return 1;
+}
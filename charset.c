@@ -33,6 +33,8 @@ static wchar cp_default_wchar;
 static char cp_default_char[4];
 
 int cs_cur_max;
+bool cs_ascii_compatible;
+bool cs_utf8;
 
 static const struct {
   ushort cp;
@@ -264,6 +266,19 @@ update_mode(void)
   get_cp_info();
 #endif
 
+  cs_utf8 = codepage == CP_UTF8;
+
+  // Check whether printable ASCII characters map to themselves, in which
+  // case the terminal can write runs of them without decoding each one.
+  char s[0x60];
+  wchar ws[0x60];
+  for (uint i = 0; i < 0x5F; i++)
+    s[i] = 0x20 + i;
+  s[0x5F] = 0;
+  cs_ascii_compatible = cs_mbstowcs(ws, s, lengthof(ws)) == 0x5F;
+  for (uint i = 0; i < 0x5F && cs_ascii_compatible; i++)
+    cs_ascii_compatible = ws[i] == (wchar)s[i];
+
   // Clear output conversion state.
   cs_mb1towc(0, 0);
 }
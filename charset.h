@@ -48,6 +48,12 @@ extern string charset_menu[];
 
 int cs_cur_max;
 
+// True if printable ASCII characters decode to themselves.
+extern bool cs_ascii_compatible;
+
+// True if the active charset is UTF-8, which the terminal decodes itself.
+extern bool cs_utf8;
+
 extern bool font_ambig_wide;
 
 #if HAS_LOCALES
@@ -80,6 +80,9 @@ const config default_cfg = {
   .word_chars = "",
   .use_system_colours = false,
   .ime_cursor_colour = DEFAULT_COLOUR,
+  .scrollback_file = false,
+  .scrollback_size = 0,
+  .session_file = "",
   .ansi_colours = {
     [BLACK_I]        = 0x000000,
     [RED_I]          = 0x0000BF,
@@ -190,6 +193,9 @@ options[] = {
   {"RowSpacing", OPT_INT, offcfg(row_spacing)},
   {"WordChars", OPT_STRING, offcfg(word_chars)},
   {"IMECursorColour", OPT_COLOUR, offcfg(ime_cursor_colour)},
+  {"ScrollbackFile", OPT_BOOL, offcfg(scrollback_file)},
+  {"ScrollbackSize", OPT_INT, offcfg(scrollback_size)},
+  {"SessionFile", OPT_STRING, offcfg(session_file)},
   
   // ANSI colours
   {"Black", OPT_COLOUR, offcfg(ansi_colours[BLACK_I])},
@@ -523,6 +529,7 @@ finish_config(void)
   cfg.rows = max(1, cfg.rows);
   cfg.cols = max(1, cfg.cols);
   cfg.scrollback_lines = max(0, cfg.scrollback_lines);
+  cfg.scrollback_size = max(0, cfg.scrollback_size);
   
   // Ignore charset setting if we haven't got a locale.
   if (!*cfg.locale)
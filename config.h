@@ -98,6 +98,9 @@ typedef struct {
   int col_spacing, row_spacing;
   string word_chars;
   colour ime_cursor_colour;
+  bool scrollback_file;
+  int scrollback_size;
+  string session_file;
   colour ansi_colours[16];
   // Legacy
   bool use_system_colours;
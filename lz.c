@@ -0,0 +1,162 @@
+// lz.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "lz.h"
+
+/*
+ * A small and fast LZ77 codec along the lines of LZ4, used for packing
+ * blocks of scrollback.
+ *
+ * The compressed data is a sequence of records, each consisting of:
+ *  - a token byte, with the number of literals in the high nibble and the
+ *    match length minus four in the low nibble,
+ *  - more bytes for the number of literals if the nibble is 15, each
+ *    adding its value, until one that isn't 255,
+ *  - the literals themselves,
+ *  - the match offset as a little-endian 16-bit number,
+ *  - more bytes for the match length if its nibble is 15, as above.
+ * The last record ends after its literals.
+ */
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 0xFFFF
+#define HASH_BITS 13
+
+static inline uint
+read32(const uchar *p)
+{
+  uint v;
+  memcpy(&v, p, sizeof v);
+  return v;
+}
+
+static inline uint
+hash(uint v)
+{ return (v * 2654435761U) >> (32 - HASH_BITS); }
+
+static uchar *
+put_length(uchar *op, uint len)
+{
+  for (; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/*
+ * Compress `len' bytes from `src' into `dst', which must have room for
+ * lz_bound(len) bytes. Returns the compressed length.
+ */
+uint
+lz_compress(const uchar *src, uint len, uchar *dst)
+{
+  uint table[1 << HASH_BITS];
+  memset(table, 0, sizeof table);
+
+  const uchar *ip = src, *anchor = src, *end = src + len;
+  const uchar *limit = len >= MIN_MATCH ? end - MIN_MATCH : src;
+  uchar *op = dst;
+
+  while (ip < limit) {
+    uint v = read32(ip);
+    uint h = hash(v);
+    const uchar *ref = src + table[h];
+    table[h] = ip - src;
+    if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != v) {
+      // Skip ahead faster the longer we go without finding a match.
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    // Extend the match backwards over literals and then forwards.
+    while (ip > anchor && ref > src && ip[-1] == ref[-1])
+      ip--, ref--;
+    const uchar *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+    while (m < end && *m == *r)
+      m++, r++;
+
+    uint lits = ip - anchor, mlen = m - ip - MIN_MATCH;
+    uchar *token = op++;
+    *token = (min(lits, 15) << 4) | min(mlen, 15);
+    if (lits >= 15)
+      op = put_length(op, lits - 15);
+    memcpy(op, anchor, lits);
+    op += lits;
+    uint offset = ip - ref;
+    *op++ = offset;
+    *op++ = offset >> 8;
+    if (mlen >= 15)
+      op = put_length(op, mlen - 15);
+
+    ip = anchor = m;
+  }
+
+  // Finish with the remaining literals.
+  uint lits = end - anchor;
+  *op++ = min(lits, 15) << 4;
+  if (lits >= 15)
+    op = put_length(op, lits - 15);
+  memcpy(op, anchor, lits);
+  op += lits;
+
+  return op - dst;
+}
+
+/*
+ * Decompress `len' bytes from `src' into `dst', which has room for `size'
+ * bytes. Returns the decompressed length, or -1 if the data is corrupt.
+ */
+int
+lz_decompress(const uchar *src, uint len, uchar *dst, uint size)
+{
+  const uchar *ip = src, *iend = src + len;
+  uchar *op = dst, *oend = dst + size;
+
+  bool get_length(uint *len) {
+    uchar b;
+    do {
+      if (ip >= iend)
+        return false;
+      *len += b = *ip++;
+    } while (b == 255);
+    return true;
+  }
+
+  while (ip < iend) {
+    uint token = *ip++;
+
+    uint lits = token >> 4;
+    if (lits == 15 && !get_length(&lits))
+      return -1;
+    if (lits > (uint)(iend - ip) || lits > (uint)(oend - op))
+      return -1;
+    memcpy(op, ip, lits);
+    op += lits;
+    ip += lits;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    uint offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    uint mlen = token & 15;
+    if (mlen == 15 && !get_length(&mlen))
+      return -1;
+    mlen += MIN_MATCH;
+    if (!offset || offset > (uint)(op - dst) || mlen > (uint)(oend - op))
+      return -1;
+
+    const uchar *r = op - offset;
+    if (offset >= mlen)
+      memcpy(op, r, mlen);
+    else {
+      // Overlapping match, repeating the last `offset' bytes.
+      for (uint i = 0; i < mlen; i++)
+        op[i] = r[i];
+    }
+    op += mlen;
+  }
+
+  return op - dst;
+}
@@ -0,0 +1,10 @@
+#ifndef LZ_H
+#define LZ_H
+
+/* Maximum size of the compressed form of `len' bytes. */
+#define lz_bound(len) ((len) + (len) / 255 + 16)
+
+uint lz_compress(const uchar *src, uint len, uchar *dst);
+int lz_decompress(const uchar *src, uint len, uchar *dst, uint size);
+
+#endif
@@ -79,9 +79,10 @@ int
 term_last_nonempty_line(void)
 {
   for (int i = term.rows - 1; i >= 0; i--) {
-    termline *line = term.lines[i];
+    termline *line = term_rawline(i);
     if (line) {
-      for (int j = 0; j < line->cols; j++)
+      int cols = line->blank ? 1 : line->cols;
+      for (int j = 0; j < cols; j++)
         if (!termchars_equal(&line->chars[j], &term.erase_char))
           return i;
     }
@@ -101,6 +102,7 @@ void
 term_reset(void)
 {
   term.state = NORMAL;
+  term_clear_mb_char();
 
   term_cursor_reset(&term.curs);
   term_cursor_reset(&term.saved_cursors[0]);
@@ -126,6 +128,7 @@ term_reset(void)
   term.report_focus = term.report_ambig_width = 0;
   term.bracketed_paste = false;
   term.show_scrollbar = true;
+  term.sync_output = false;
 
   term.marg_top = 0;
   term.marg_bot = term.rows - 1;
@@ -202,65 +205,6 @@ term_reconfig(void)
     term.vt220_keys = strstr(new_cfg.term, "vt220");
 }
 
-static void
-scrollback_push(uchar *line)
-{
-  if (term.sblines == term.sblen) {
-    // Need to make space for the new line.
-    if (term.sblen < cfg.scrollback_lines) {
-      // Expand buffer
-      assert(term.sbpos == 0);
-      int new_sblen = min(cfg.scrollback_lines, term.sblen * 3 + 1024);
-      term.scrollback = renewn(term.scrollback, new_sblen);
-      term.sbpos = term.sblen;
-      term.sblen = new_sblen;
-    }
-    else if (term.sblines) {
-      // Throw away the oldest line
-      free(term.scrollback[term.sbpos]);
-      term.sblines--;
-    }
-    else
-      return;
-  }
-  assert(term.sblines < term.sblen);
-  assert(term.sbpos < term.sblen);
-  term.scrollback[term.sbpos++] = line;
-  if (term.sbpos == term.sblen)
-    term.sbpos = 0;
-  term.sblines++;
-  if (term.tempsblines < term.sblines)
-    term.tempsblines++;
-}
-
-static uchar *
-scrollback_pop(void)
-{
-  assert(term.sblines > 0);
-  assert(term.sbpos < term.sblen);
-  term.sblines--;
-  if (term.tempsblines)
-    term.tempsblines--;
-  if (term.sbpos == 0)
-    term.sbpos = term.sblen;
-  return term.scrollback[--term.sbpos];
-}
-
-/*
- * Clear the scrollback.
- */
-void
-term_clear_scrollback(void)
-{
-  while (term.sblines)
-    free(scrollback_pop());
-  free(term.scrollback);
-  term.scrollback = 0;
-  term.sblen = term.sblines = term.sbpos = 0;
-  term.tempsblines = 0;
-  term.disptop = 0;
-}
-
 /*
  * Set up the terminal for a given size.
  */
@@ -295,6 +239,20 @@ term_resize(int newrows, int newcols)
   *    away.
   */
 
+  // Decompressed scrollback lines may no longer have the right size.
+  scrollback_uncache();
+
+  // Straighten out the row ring, so that it can be treated as an array.
+  int origin = term.lines_origin;
+  if (origin) {
+    termline *top[origin];
+    memcpy(top, term.lines, sizeof top);
+    memmove(term.lines, term.lines + origin,
+            (term.rows - origin) * sizeof(termline *));
+    memcpy(term.lines + term.rows - origin, top, sizeof top);
+    term.lines_origin = 0;
+  }
+
   termlines *lines = term.lines;
   term_cursor *curs = &term.curs;
   term_cursor *saved_curs = &term.saved_cursors[term.on_alt_screen];
@@ -306,11 +264,8 @@ term_resize(int newrows, int newcols)
     int store = removed - destroy;
     
     // Push removed lines into scrollback
-    for (int i = 0; i < store; i++) {
-      termline *line = lines[i];
-      scrollback_push(compressline(line));
-      freeline(line);
-    }
+    for (int i = 0; i < store; i++)
+      freeline(scrollback_push(lines[i]));
 
     // Move up remaining lines
     memmove(lines, lines + store, newrows * sizeof(termline *));
@@ -340,13 +295,8 @@ term_resize(int newrows, int newcols)
     memmove(lines + restore, lines, term.rows * sizeof(termline *));
     
     // Restore lines from scrollback
-    for (int i = restore; i--;) {
-      uchar *cline = scrollback_pop();
-      termline *line = decompressline(cline, null);
-      free(cline);
-      line->temporary = false;  /* reconstituted line is now real */
-      lines[i] = line;
-    }
+    for (int i = restore; i--;)
+      lines[i] = scrollback_pop();
     
     // Adjust cursor position
     curs->y += restore;
@@ -365,10 +315,14 @@ term_resize(int newrows, int newcols)
   term.displines = renewn(term.displines, newrows);
   for (int i = 0; i < newrows; i++) {
     termline *line = newline(newcols, false);
+    fillline(line);
     term.displines[i] = line;
     for (int j = 0; j < newcols; j++)
       line->chars[j].attr = ATTR_INVALID;
   }
+  term.disprows = renewn(term.disprows, newrows);
+  memset(term.disprows, 0, newrows * sizeof(disprow));
+  term.scrolled.mixed = true;
 
   // Make a new alternate screen.
   lines = term.other_lines;
@@ -379,6 +333,7 @@ term_resize(int newrows, int newcols)
   term.other_lines = lines = renewn(lines, newrows);
   for (int i = 0; i < newrows; i++)
     lines[i] = newline(newcols, true);
+  term.other_lines_origin = 0;
 
   // Reset tab stops
   term.tabs = renewn(term.tabs, newcols);
@@ -413,10 +368,14 @@ term_switch_screen(bool to_alt, bool reset)
     return;
 
   term.on_alt_screen = to_alt;
+  term.scrolled.mixed = true;
 
   termlines *oldlines = term.lines;
   term.lines = term.other_lines;
   term.other_lines = oldlines;
+  int oldorigin = term.lines_origin;
+  term.lines_origin = term.other_lines_origin;
+  term.other_lines_origin = oldorigin;
   
   if (to_alt && reset)
     term_erase(false, false, true, true);
@@ -448,7 +407,7 @@ term_check_boundary(int x, int y)
   if (x == 0 || x > term.cols)
     return;
 
-  termline *line = term.lines[y];
+  termline *line = term_line_span(y, x - 1, x + 1);
   if (x == term.cols)
     line->attr &= ~LATTR_WRAPPED2;
   else if (line->chars[x].chr == UCSWIDE) {
@@ -477,35 +436,54 @@ term_do_scroll(int topline, int botline, int lines, bool sb)
   // Don't try to scroll more than the number of lines in the scroll region.
   int lines_in_region = botline - topline;
   lines = min(lines, lines_in_region);
+
+  // Record the scroll for term_paint(), so that it can move the display
+  // contents rather than redraw them. Only repeated scrolls of the same
+  // region while the bottom of the screen is shown can be combined.
+  if (!term.show_other_screen) {
+    typeof(term.scrolled) *s = &term.scrolled;
+    if (!s->lines)
+      s->top = topline, s->bot = botline;
+    if (topline == s->top && botline == s->bot && !term.disptop)
+      s->lines += down ? -lines : lines;
+    else
+      s->mixed = true;
+  }
   
-  // Number of lines that are moved up or down as they are.
-  // The rest are scrolled out of the region and replaced by empty lines.
-  int moved_lines = lines_in_region - lines;
-  
-  // Useful pointers to the top and (one below the) bottom lines.
-  termline **top = term.lines + topline;
-  termline **bot = term.lines + botline;
-  
-  // Reuse lines that are being scrolled out of the scroll region,
-  // clearing their content.
-  termline *recycled[abs(lines)];
-  void recycle(termline **src) {
-    memcpy(recycled, src, sizeof recycled);
+  // Rotate the scroll region upwards by the given number of lines.
+  // The rows of the whole screen are already in a ring, so only its origin
+  // needs moving when scrolling the full screen.
+  void rotate(int by) {
+    if (lines_in_region == term.rows)
+      term.lines_origin = (term.lines_origin + by) % term.rows;
+    else {
+      termline *region[lines_in_region];
+      for (int i = 0; i < lines_in_region; i++)
+        region[i] = term_rawline(topline + i);
+      for (int i = 0; i < lines_in_region; i++)
+        term.lines[ring_row(term.lines_origin, topline + i)] =
+          region[(i + by) % lines_in_region];
+    }
+  }
+
+  // Clear the lines that were scrolled out and came back in at the other
+  // end of the region.
+  void clear(int y) {
     for (int i = 0; i < lines; i++)
-      clearline(recycled[i]);
+      clearline(term_rawline(y + i));
   }
 
   if (down) {
     // Move down remaining lines and push in the recycled lines
-    recycle(bot - lines);
-    memmove(top + lines, top, moved_lines * sizeof(termline *));
-    memcpy(top, recycled, sizeof recycled);
+    rotate(lines_in_region - lines);
+    clear(topline);
 
     // Move selection markers if they're within the scroll region
-    void scroll_pos(pos *p) {
-      if (!term.show_other_screen && p->y >= topline && p->y < botline) {
-        if ((p->y += lines) >= botline)
-          *p = (pos){.y = botline, .x = 0};
+    long long top = line_number(topline), bot = line_number(botline);
+    void scroll_pos(selpos *p) {
+      if (!term.show_other_screen && p->y >= top && p->y < bot) {
+        if ((p->y += lines) >= bot)
+          *p = (selpos){.y = bot, .x = 0};
       }
     }
     scroll_pos(&term.sel_start);
@@ -513,31 +491,51 @@ term_do_scroll(int topline, int botline, int lines, bool sb)
     scroll_pos(&term.sel_end);
   }
   else {
-    int seltop = topline;
+    long long seltop = line_number(topline), bot = line_number(botline);
+    int shift = lines;
 
     // Only push lines into the scrollback when scrolling off the top of the
-    // normal screen and scrollback is actually enabled.
+    // normal screen and scrollback is actually enabled. The scrollback
+    // takes over the lines and gives back others to be recycled.
     if (sb && topline == 0 && !term.on_alt_screen && cfg.scrollback_lines) {
-      for (int i = 0; i < lines; i++)
-        scrollback_push(compressline(term.lines[i]));
+      for (int i = 0; i < lines; i++) {
+        termline **line = &term.lines[ring_row(term.lines_origin, i)];
+        *line = scrollback_push(*line);
+      }
  
-      // Shift viewpoint accordingly if user is looking at scrollback
-      if (term.disptop < 0)
+      // Shift viewpoint accordingly if user is looking at scrollback.
+      // While a selection is being made, also hold it still at the bottom,
+      // remembering how far back that has taken it.
+      bool hold = term_selecting() &&
+                  (!term.disptop || term.disptop == -term.sel_held);
+      if (term.disptop < 0 || hold) {
         term.disptop = max(term.disptop - lines, -term.sblines);
+        if (hold)
+          term.sel_held = -term.disptop;
+      }
 
-      seltop = -term.sblines;
+      // The pushed lines keep their numbers, so only evicted ones
+      // and those below the scroll region need adjusting.
+      seltop = line_number(-term.sblines);
+      shift = 0;
+      void below_pos(selpos *p) {
+        if (!term.show_other_screen && p->y >= bot)
+          p->y += lines;
+      }
+      below_pos(&term.sel_start);
+      below_pos(&term.sel_anchor);
+      below_pos(&term.sel_end);
     }
     
     // Move up remaining lines and push in the recycled lines
-    recycle(top);
-    memmove(top, top + lines, moved_lines * sizeof(termline *));
-    memcpy(bot - lines, recycled, sizeof recycled);
+    rotate(lines);
+    clear(botline - lines);
 
     // Move selection markers if they're within the scroll region
-    void scroll_pos(pos *p) {
-      if (!term.show_other_screen && p->y >= seltop && p->y < botline) {
-        if ((p->y -= lines) < seltop)
-          *p = (pos){.y = seltop, .x = 0};
+    void scroll_pos(selpos *p) {
+      if (!term.show_other_screen && p->y >= seltop && p->y < bot) {
+        if ((p->y -= shift) < seltop)
+          *p = (selpos){.y = seltop, .x = 0};
       }
     }
     scroll_pos(&term.sel_start);
@@ -593,22 +591,43 @@ term_erase(bool selective, bool line_only, bool from_begin, bool to_end)
       term.tempsblines = 0;
   }
   else {
-    termline *line = term.lines[start.y];
     while (poslt(start, end)) {
-      if (start.x == term.cols) {
+      if (start.x == 0 && start.y < end.y && !selective) {
+       /* Whole lines can simply be cleared. */
+        termline *line = term_rawline(start.y);
+        int lattr = line->attr;
+        clearline(line);
         if (line_only)
-          line->attr &= ~(LATTR_WRAPPED | LATTR_WRAPPED2);
-        else
-          line->attr = LATTR_NORM;
+          line->attr = lattr & ~(LATTR_WRAPPED | LATTR_WRAPPED2);
+        start.y++;
+        continue;
       }
-      else if (!selective || !(line->chars[start.x].attr & ATTR_PROTECTED))
-        line->chars[start.x] = term.erase_char;
-      if (incpos(start) && start.y < term.rows)
-        line = term.lines[start.y];
+      termline *line =
+        term_line_span(start.y, start.x, end.y > start.y ? term.cols : end.x);
+      do {
+        if (start.x == term.cols) {
+          if (line_only)
+            line->attr &= ~(LATTR_WRAPPED | LATTR_WRAPPED2);
+          else
+            line->attr = LATTR_NORM;
+        }
+        else if (!selective || !(line->chars[start.x].attr & ATTR_PROTECTED))
+          line->chars[start.x] = term.erase_char;
+      } while (!incpos(start) && poslt(start, end));
     }
   }
 }
 
+/*
+ * Mark display rows for a full check in the next term_paint().
+ */
+void
+disprows_invalidate(int top, int bottom)
+{
+  for (int i = max(top, 0); i <= bottom && i < term.rows; i++)
+    term.disprows[i].line = null;
+}
+
 void
 term_paint(void)
 {
@@ -616,76 +635,203 @@ term_paint(void)
   int curs_y =
     term.cursor_on && !term.show_other_screen
     ? term.curs.y - term.disptop : -1;
+  int curs_attr =
+    (!term.has_focus ? TATTR_PASCURS :
+     term.cblinker || !term_cursor_blinks() ? TATTR_ACTCURS : 0) |
+    (term.curs.wrapnext ? TATTR_RIGHTCURS : 0);
+  bool blink_on = term.has_focus && term.tblinker;
+  bool searching = search_update();
+
+ /*
+  * Work out which rows are affected by changes other than to the lines
+  * themselves. Those get checked in full, while other rows only need
+  * checking where their line has changed since the last paint.
+  */
+  typeof(term.painted) *p = &term.painted;
+
+ /* The selection as it sits on the screen right now. */
+  pos sel_start = sel_rel(term.sel_start), sel_end = sel_rel(term.sel_end);
+
+ /*
+  * If the screen has been scrolled, try to move the display contents
+  * accordingly, so that only the uncovered rows need drawing. The display
+  * rows are moved along to match.
+  */
+  typeof(term.scrolled) s = term.scrolled;
+  term.scrolled = (typeof(s)){.lines = 0};
+  int size = s.bot - s.top, n = s.lines;
+  if (n && !s.mixed && abs(n) < size &&
+      !term.disptop && !p->disptop && term.in_vbell == p->vbell &&
+      win_scroll(s.top, s.bot, n)) {
+    termline *displines[size];
+    disprow disprows[size];
+    memcpy(displines, term.displines + s.top, sizeof displines);
+    memcpy(disprows, term.disprows + s.top, sizeof disprows);
+    for (int i = 0; i < size; i++) {
+      int j = (i + n + size) % size;
+      term.displines[s.top + i] = displines[j];
+      term.disprows[s.top + i] = disprows[j];
+    }
+    if (n > 0)
+      term_invalidate(0, s.bot - n, term.cols - 1, s.bot - 1);
+    else
+      term_invalidate(0, s.top, term.cols - 1, s.top - n - 1);
+
+   /* The old cursor and selection have moved too, if they were inside. */
+    if (p->curs_y >= s.top && p->curs_y < s.bot)
+      p->curs_y -= n;
+    if (p->selected) {
+      disprows_invalidate(p->sel_start.y - max(n, 0),
+                          p->sel_end.y - min(n, 0));
+    }
+  }
+
+  if (term.disptop != p->disptop || term.in_vbell != p->vbell)
+    disprows_invalidate(0, term.rows - 1);
+  if (curs_y != p->curs_y || term.curs.x != p->curs_x ||
+      curs_attr != p->curs_attr || term.cursor_invalid) {
+    disprows_invalidate(p->curs_y, p->curs_y);
+    disprows_invalidate(curs_y, curs_y);
+  }
+  if (term.selected != p->selected || term.sel_rect != p->sel_rect ||
+      !poseq(sel_start, p->sel_start) || !poseq(sel_end, p->sel_end)) {
+    if (p->selected)
+      disprows_invalidate(p->sel_start.y - p->disptop,
+                          p->sel_end.y - p->disptop);
+    if (term.selected)
+      disprows_invalidate(sel_start.y - term.disptop,
+                          sel_end.y - term.disptop);
+  }
+  if (blink_on != p->blink_on || term.blink_is_real != p->blink_is_real) {
+    for (int i = 0; i < term.rows; i++) {
+      if (term.disprows[i].blink)
+        term.disprows[i].line = null;
+    }
+  }
+  *p = (typeof(*p)){
+    .curs_y = curs_y, .curs_x = term.curs.x, .curs_attr = curs_attr,
+    .disptop = term.disptop, .vbell = term.in_vbell,
+    .blink_on = blink_on, .blink_is_real = term.blink_is_real,
+    .selected = term.selected, .sel_rect = term.sel_rect,
+    .sel_start = sel_start, .sel_end = sel_end
+  };
+
+ /* After a jump into the scrollback, decode its rows all at once. */
+  if (term.disptop < 0)
+    scrollback_prefetch(term.disptop, min(term.rows, -term.disptop));
 
   for (int i = 0; i < term.rows; i++) {
     pos scrpos;
     scrpos.y = i + term.disptop;
 
-   /* Do Arabic shaping and bidi. */
     termline *line = fetch_line(scrpos.y);
+    disprow *row = &term.disprows[i];
+    bool check_all = row->line != line || line->temporary;
+    if (!check_all && line->dirty_lo >= line->dirty_hi) {
+     /* Nothing has changed. */
+      release_line(line);
+      continue;
+    }
+
+   /* Do Arabic shaping and bidi. */
     termchar *chars = term_bidi_line(line, i);
     int *backward = chars ? term.post_bidi_cache[i].backward : 0;
     int *forward = chars ? term.post_bidi_cache[i].forward : 0;
+    bool plain = !chars || term.post_bidi_cache[i].plain;
     chars = chars ?: line->chars;
 
     termline *displine = term.displines[i];
     termchar *dispchars = displine->chars;
     termchar newchars[term.cols];
 
-  /*
+   /* Matches can extend beyond the columns that have changed. */
+    bool found[term.cols];
+    bool any_found = searching && search_marks(line, found);
+
+   /*
+    * Unless something has happened that affects the whole row, we only
+    * need to look at the columns that have changed, plus the one to their
+    * left, whose width depends on the first one. That range is widened to
+    * the runs of text that were drawn there in the previous update,
+    * because those have to be redrawn in their entirety (see below).
+    */
+    int from = 0, to = term.cols;
+    if (check_all || searching || i == curs_y || !plain || !row->plain ||
+        line->attr != displine->attr)
+      row->blink = false;
+    else {
+      from = max(line->dirty_lo - 1, 0);
+      to = min(line->dirty_hi, term.cols);
+      while (from > 0 && !(dispchars[from].attr & DATTR_STARTRUN))
+        from--;
+      while (to < term.cols && !(dispchars[to].attr & DATTR_STARTRUN))
+        to++;
+    }
+
+   /*
     * First loop: work along the line deciding what we want
     * each character cell to look like.
     */
-    for (int j = 0; j < term.cols; j++) {
-      termchar *d = chars + j;
-      scrpos.x = backward ? backward[j] : j;
-      wchar tchar = d->chr;
-      uint tattr = d->attr;
-      
-     /* Many Windows fonts don't have the Unicode hyphen, but groff
-      * uses it for man pages, so display it as the ASCII version.
-      */
-      if (tchar == 0x2010)
-        tchar = '-';
-
-      if (j < term.cols - 1 && d[1].chr == UCSWIDE)
-        tattr |= ATTR_WIDE;
-
-     /* Video reversing things */
-      bool selected = 
-        term.selected &&
-        ( term.sel_rect
-          ? posPle(term.sel_start, scrpos) && posPlt(scrpos, term.sel_end)
-          : posle(term.sel_start, scrpos) && poslt(scrpos, term.sel_end)
-        );
-      if (term.in_vbell || selected)
-        tattr ^= ATTR_REVERSE;
-
-     /* 'Real' blinking ? */
-      if (term.blink_is_real && (tattr & ATTR_BLINK)) {
-        if (term.has_focus && term.tblinker)
-          tchar = ' ';
-        tattr &= ~ATTR_BLINK;
-      }
+    void prepare(int from, int to) {
+      for (int j = from; j < to; j++) {
+        termchar *d = chars + j;
+        scrpos.x = backward ? backward[j] : j;
+        wchar tchar = d->chr;
+        uint tattr = d->attr;
+        
+       /* Many Windows fonts don't have the Unicode hyphen, but groff
+        * uses it for man pages, so display it as the ASCII version.
+        */
+        if (tchar == 0x2010)
+          tchar = '-';
+
+        if (j < term.cols - 1 && d[1].chr == UCSWIDE)
+          tattr |= ATTR_WIDE;
+
+       /* Video reversing things */
+        bool selected = 
+          term.selected &&
+          ( term.sel_rect
+            ? posPle(sel_start, scrpos) && posPlt(scrpos, sel_end)
+            : posle(sel_start, scrpos) && poslt(scrpos, sel_end)
+          );
+        if (term.in_vbell || selected)
+          tattr ^= ATTR_REVERSE;
+        else if (any_found && found[scrpos.x]) {
+          tattr &= ~(ATTR_FGMASK | ATTR_BGMASK | ATTR_REVERSE);
+          tattr |= BLACK_I << ATTR_FGSHIFT | BOLD_YELLOW_I << ATTR_BGSHIFT;
+        }
 
-     /*
-      * Check the font we'll _probably_ be using to see if 
-      * the character is wide when we don't want it to be.
-      */
-      if (tchar != dispchars[j].chr ||
-          tattr != (dispchars[j].attr & ~(ATTR_NARROW | DATTR_MASK))) {
-        if ((tattr & ATTR_WIDE) == 0 && win_char_width(tchar) == 2)
+       /* 'Real' blinking ? */
+        if (tattr & ATTR_BLINK) {
+          row->blink = true;
+          if (term.blink_is_real) {
+            if (blink_on)
+              tchar = ' ';
+            tattr &= ~ATTR_BLINK;
+          }
+        }
+
+       /*
+        * Check the font we'll _probably_ be using to see if 
+        * the character is wide when we don't want it to be.
+        */
+        if (tchar != dispchars[j].chr ||
+            tattr != (dispchars[j].attr & ~(ATTR_NARROW | DATTR_MASK))) {
+          if ((tattr & ATTR_WIDE) == 0 && win_char_width(tchar) == 2)
+            tattr |= ATTR_NARROW;
+        }
+        else if (dispchars[j].attr & ATTR_NARROW)
           tattr |= ATTR_NARROW;
+
+       /* FULL-TERMCHAR */
+        newchars[j].attr = tattr;
+        newchars[j].chr = tchar;
+       /* Combining characters are still read from chars */
+        newchars[j].cc_next = 0;
       }
-      else if (dispchars[j].attr & ATTR_NARROW)
-        tattr |= ATTR_NARROW;
-
-     /* FULL-TERMCHAR */
-      newchars[j].attr = tattr;
-      newchars[j].chr = tchar;
-     /* Combining characters are still read from chars */
-      newchars[j].cc_next = 0;
     }
+    prepare(from, to);
 
     if (i == curs_y) {
      /* Determine the column the cursor is on, taking bidi into account and
@@ -699,10 +845,7 @@ term_paint(void)
         curs_x--;
 
      /* Determine cursor cell attributes. */
-      newchars[curs_x].attr |=
-        (!term.has_focus ? TATTR_PASCURS :
-         term.cblinker || !term_cursor_blinks() ? TATTR_ACTCURS : 0) |
-        (term.curs.wrapnext ? TATTR_RIGHTCURS : 0);
+      newchars[curs_x].attr |= curs_attr;
       
       if (term.cursor_invalid)
         dispchars[curs_x].attr |= ATTR_INVALID;
@@ -722,9 +865,9 @@ term_paint(void)
     * bounding rectangle, should solve any possible problems
     * with fonts that overflow their character cells.
     */
-    int laststart = 0;
+    int laststart = from;
     bool dirtyrect = false;
-    for (int j = 0; j < term.cols; j++) {
+    for (int j = from; j < to; j++) {
       if (dispchars[j].attr & DATTR_STARTRUN) {
         laststart = j;
         dirtyrect = false;
@@ -751,17 +894,23 @@ term_paint(void)
     bool dirty_run = (line->attr != displine->attr);
     bool dirty_line = dirty_run;
     uint attr = 0;
-    int start = 0;
+    int start = from;
 
     displine->attr = line->attr;
 
-    for (int j = 0; j < term.cols; j++) {
+    for (int j = from; j < to; j++) {
       termchar *d = chars + j;
       uint tattr = newchars[j].attr;
       wchar tchar = newchars[j].chr;
 
-      if ((dispchars[j].attr ^ tattr) & ATTR_WIDE)
+      if ((dispchars[j].attr ^ tattr) & ATTR_WIDE) {
+        if (!dirty_line && to < term.cols) {
+         /* The rest of the line needs redrawing after all. */
+          prepare(to, term.cols);
+          to = term.cols;
+        }
         dirty_line = true;
+      }
 
       bool break_run = tattr ^ attr;
 
@@ -827,6 +976,11 @@ term_paint(void)
     }
     if (dirty_run && textlen)
       win_text(start, i, text, textlen, attr, line->attr);
+
+    row->line = line->temporary ? null : line;
+    row->plain = plain;
+    line->dirty_lo = line->cols;
+    line->dirty_hi = 0;
     release_line(line);
   }
 
@@ -845,6 +999,7 @@ term_invalidate(int left, int top, int right, int bottom)
   if (bottom >= term.rows)
     bottom = term.rows - 1;
 
+  disprows_invalidate(top, bottom);
   for (int i = top; i <= bottom && i < term.rows; i++) {
     if ((term.displines[i]->attr & LATTR_MODE) == LATTR_NORM)
       for (int j = left; j <= right && j < term.cols; j++)
@@ -889,11 +1044,22 @@ void
 term_update_cs()
 {
   term_cursor *curs = &term.curs;
+  bool utf8 = cs_utf8;
   cs_set_mode(
     curs->oem_acs ? CSM_OEM :
     curs->utf ? CSM_UTF8 :
     curs->csets[curs->g1] == CSET_OEM ? CSM_OEM : CSM_DEFAULT
   );
+  if (cs_utf8 != utf8)
+    term_clear_mb_char();
+}
+
+/* Drop any partial multibyte character left by the previous charset. */
+void
+term_clear_mb_char(void)
+{
+  term.utf8_need = 0;
+  term.in_mb_char = false;
 }
 
 int
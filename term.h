@@ -150,22 +150,32 @@ typedef struct {
   ushort cols;    /* number of real columns on the line */
   ushort size;    /* number of allocated termchars
                      (cc-lists may make this > cols) */
-  bool temporary; /* true if decompressed from scrollback */
+  bool temporary; /* true if to be freed by release_line() */
+  bool blank;     /* chars[0] is to be repeated across the line */
+  ushort dirty_lo, dirty_hi; /* columns changed since the last paint */
   short cc_free;  /* offset to first cc in free list */
   termchar *chars;
 } termline;
 
 typedef termline *termlines;
 
+typedef struct {
+  termline *line; /* line last painted into the row, or null to check it */
+  bool plain;     /* line was painted without bidi reordering or shaping */
+  bool blink;     /* row contains blinking text */
+} disprow;
+
 typedef struct {
   int width;
   termchar *chars;
   int *forward, *backward;      /* the permutations of line positions */
+  bool plain;   /* no reordering or shaping took place */
 } bidi_cache_entry;
 
 termline *newline(int cols, int bce);
 void freeline(termline *);
 void clearline(termline *);
+void fillline(termline *);
 void resizeline(termline *, int);
 
 int sblines(void);
@@ -181,7 +191,7 @@ void move_termchar(termline *line, termchar *dest, termchar *src);
 void add_cc(termline *, int col, wchar chr);
 void clear_cc(termline *, int col);
 
-uchar *compressline(termline *);
+uint compressline(termline *, uchar **data, uint *size);
 termline *decompressline(uchar *, int *bytes_used);
 
 termchar *term_bidi_line(termline *, int scr_y);
@@ -198,6 +208,13 @@ typedef struct {
   int y, x;
 } pos;
 
+/* A position by absolute line number (see line_number() in termsb.c),
+ * which stays with its line as it scrolls into and out of the scrollback. */
+typedef struct {
+  long long y;
+  int x;
+} selpos;
+
 typedef enum {
   MBT_LEFT = 1, MBT_MIDDLE = 2, MBT_RIGHT = 3
 } mouse_button;
@@ -224,24 +241,32 @@ struct term {
   bool show_other_screen;
 
   termlines *lines, *other_lines;
+  int lines_origin, other_lines_origin; /* ring index of top screen row */
   term_cursor curs, saved_cursors[2];
 
-  uchar **scrollback;     /* lines scrolled off top of screen */
   int disptop;            /* distance scrolled back (0 or -ve) */
-  int sblen;              /* length of scrollback buffer */
-  int sblines;            /* number of lines of scrollback */
-  int sbpos;              /* index of next scrollback position to be filled */
+  int sblines;            /* number of lines of scrollback (see termsb.c) */
   int tempsblines;        /* number of lines of .scrollback that
                            * can be retrieved onto the terminal
                            * ("temporary scrollback") */
 
   termlines *displines;   /* buffer of text on real screen */
+  disprow *disprows;      /* where the displines came from */
+  struct {
+    int curs_y, curs_x, curs_attr;
+    int disptop;
+    bool vbell, blink_on, blink_is_real;
+    bool selected, sel_rect;
+    pos sel_start, sel_end;
+  } painted;              /* state that the displines were painted with */
+  struct {
+    int top, bot;         /* scroll region, excluding bot */
+    int lines;            /* lines scrolled up, or down if negative */
+    bool mixed;           /* scrolls that can't be combined into one */
+  } scrolled;             /* scrolling since the last paint */
 
   termchar erase_char;
 
-  char *inbuf;      /* terminal input buffer */
-  uint inbuf_size, inbuf_pos;
-
   bool rvideo;   /* global reverse video flag */
   bool cursor_on;        /* cursor enabled flag */
   bool deccolm_allowed;  /* DECCOLM sequence for 80/132 cols allowed? */
@@ -276,12 +301,14 @@ struct term {
   bool report_ambig_width;
   bool bracketed_paste;
   bool show_scrollbar;
+  bool sync_output;      // Synchronized output mode (DEC mode 2026)
+  int  sync_output_end;  // Tick count at which to paint regardless
 
   int  cursor_type;
   int  cursor_blinks;
   bool cursor_invalid;
 
-  uchar esc_mod;  // Modifier character in escape sequences
+  ushort esc_mod;  // Up to two modifier characters in escape sequences
 
   uint csi_argc;
   uint csi_argv[32];
@@ -322,7 +349,8 @@ struct term {
   } mouse_state;
 
   bool sel_rect, selected;
-  pos sel_start, sel_end, sel_anchor;
+  selpos sel_start, sel_end, sel_anchor;
+  int sel_held;           /* how far output has held the view back */
   
  /* Scroll steps during selection when cursor out of window. */
   int sel_scroll;
@@ -337,6 +365,12 @@ struct term {
  /* Non-zero when we've seen the first half of a surrogate pair */
   wchar high_surrogate;
 
+ /* UTF-8 decoder state: the character decoded so far, the number of
+  * continuation bytes still expected, and the valid range for the next one.
+  */
+  xchar utf8_char;
+  uchar utf8_need, utf8_lo, utf8_hi;
+
  /*
   * These are buffers used by the bidi and Arabic shaping code.
   */
@@ -350,19 +384,28 @@ struct term {
 
 extern struct term term;
 
+typedef enum { EXPORT_TEXT, EXPORT_ANSI, EXPORT_HTML } export_format;
+
 void term_resize(int, int);
 void term_scroll(int, int);
 void term_reset(void);
 void term_clear_scrollback(void);
+void term_save_session(string path);
+bool term_load_session(string path);
 void term_mouse_click(mouse_button, mod_keys, pos, int count);
 void term_mouse_release(mouse_button, mod_keys, pos);
 void term_mouse_move(mod_keys, pos);
 void term_mouse_wheel(int delta, int lines_per_notch, mod_keys, pos);
 void term_select_all(void);
+void term_set_search(wchar *);
+bool term_search_next(bool backwards);
+int  term_search_regex(wchar *);
 void term_paint(void);
 void term_invalidate(int left, int top, int right, int bottom);
 void term_open(void);
 void term_copy(void);
+bool term_export(int fd, export_format);
+bool term_exporting(void);
 void term_paste(wchar *, uint len);
 void term_send_paste(void);
 void term_cancel_paste(void);
@@ -370,7 +413,6 @@ void term_reconfig(void);
 void term_flip_screen(void);
 void term_reset_screen(void);
 void term_write(const char *, uint len);
-void term_flush(void);
 void term_set_focus(bool has_focus);
 int  term_cursor_type(void);
 bool term_cursor_blinks(void);
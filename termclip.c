@@ -39,7 +39,7 @@ clip_addchar(clip_workbuf * b, wchar chr, int attr)
 static void
 get_selection(clip_workbuf *buf)
 {
-  pos start = term.sel_start, end = term.sel_end;
+  pos start = sel_rel(term.sel_start), end = sel_rel(term.sel_end);
   
   int old_top_x;
   int attr;
@@ -215,8 +215,8 @@ term_send_paste(void)
 void
 term_select_all(void)
 {
-  term.sel_start = (pos){-sblines(), 0};
-  term.sel_end = (pos){term_last_nonempty_line(), term.cols};
+  term.sel_start = sel_abs((pos){-sblines(), 0});
+  term.sel_end = sel_abs((pos){term_last_nonempty_line(), term.cols});
   term.selected = true;
   if (cfg.copy_on_select)
     term_copy();
@@ -0,0 +1,431 @@
+// termexport.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "termpriv.h"
+
+#include "win.h"
+#include "charset.h"
+#include "appinfo.h"
+
+#include <pthread.h>
+
+/*
+ * Exporting the scrollback and the screen to a file.
+ *
+ * The screen is compressed into a buffer when the export starts, and the
+ * scrollback lines that were there at that point are read a block at a
+ * time by a thread of its own (see scrollback_read()), so the terminal
+ * carries on as normal meanwhile. Only one block and one line are decoded
+ * at a time. Lines that get evicted from the scrollback before the thread
+ * gets to them are left out.
+ *
+ * Wrapped lines are joined up again, and the output is UTF-8 in all three
+ * formats: plain text, text with ANSI escape sequences for the attributes,
+ * and HTML with the current colours.
+ */
+
+#define EXPORT_BUF_SIZE 65536
+#define EXPORT_TICKS 200  /* milliseconds between progress updates */
+
+typedef struct {
+  int fd;
+  export_format format;
+  long long start, end;   /* scrollback lines to be exported */
+  uchar *screen;          /* compressed screen lines */
+  uint *screen_ends;
+  int rows;
+  int cols;               /* width that stored lines are restored to */
+  colour colours[COLOUR_NUM];
+  bool bold_as_colour;
+  char *head;             /* HTML header */
+  uint attr;              /* attributes at the end of the output so far */
+  char *out;
+  uint len;
+  int error;
+  volatile int done;      /* lines exported */
+  int total;              /* lines to be exported */
+  volatile bool finished;
+} export_job;
+
+static export_job *job;
+static pthread_t thread;
+
+/*
+ * Font name quoted for a CSS string in an HTML style attribute. Anything
+ * that could end the string or the attribute is written as a CSS escape.
+ */
+static char *
+css_font_name(string name)
+{
+  char *s = newn(char, strlen(name) * 4 + 1), *p = s;
+  for (; *name; name++) {
+    uchar c = *name;
+    if (c < ' ' || c == 0x7F || strchr("\"'&<>\\", c))
+      p += sprintf(p, "\\%x ", c);
+    else
+      *p++ = c;
+  }
+  *p = 0;
+  return s;
+}
+
+static void
+flush(export_job *j)
+{
+  char *p = j->out;
+  while (j->len && !j->error) {
+    ssize_t n = write(j->fd, p, j->len);
+    if (n < 0)
+      j->error = errno;
+    else {
+      p += n;
+      j->len -= n;
+    }
+  }
+  j->len = 0;
+}
+
+/* Make room for n more bytes in the output buffer. */
+static char *
+room(export_job *j, uint n)
+{
+  if (j->len + n > EXPORT_BUF_SIZE)
+    flush(j);
+  return j->out + j->len;
+}
+
+static void
+put_str(export_job *j, string s)
+{
+  uint n = strlen(s);
+  while (n) {
+    uint chunk = min(n, EXPORT_BUF_SIZE / 2);
+    memcpy(room(j, chunk), s, chunk);
+    j->len += chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+/* The attributes that show in exported text. */
+enum {
+  EXPORT_ATTRS = ATTR_FGMASK | ATTR_BGMASK | ATTR_BOLD | ATTR_DIM |
+                 ATTR_INVISIBLE | ATTR_UNDER | ATTR_REVERSE | ATTR_BLINK
+};
+
+static void
+put_sgr(export_job *j, uint attr)
+{
+  char *p = room(j, 64);
+  p += sprintf(p, "\e[0");
+  if (attr & ATTR_BOLD)
+    p += sprintf(p, ";1");
+  if (attr & ATTR_DIM)
+    p += sprintf(p, ";2");
+  if (attr & ATTR_UNDER)
+    p += sprintf(p, ";4");
+  if (attr & ATTR_BLINK)
+    p += sprintf(p, ";5");
+  if (attr & ATTR_REVERSE)
+    p += sprintf(p, ";7");
+  if (attr & ATTR_INVISIBLE)
+    p += sprintf(p, ";8");
+  uint fg = (attr & ATTR_FGMASK) >> ATTR_FGSHIFT;
+  uint bg = (attr & ATTR_BGMASK) >> ATTR_BGSHIFT;
+  if (fg < 8)
+    p += sprintf(p, ";%u", 30 + fg);
+  else if (fg < 16)
+    p += sprintf(p, ";%u", 90 + fg - 8);
+  else if (fg < 256)
+    p += sprintf(p, ";38;5;%u", fg);
+  if (bg < 8)
+    p += sprintf(p, ";%u", 40 + bg);
+  else if (bg < 16)
+    p += sprintf(p, ";%u", 100 + bg - 8);
+  else if (bg < 256)
+    p += sprintf(p, ";48;5;%u", bg);
+  *p++ = 'm';
+  j->len = p - j->out;
+}
+
+/* Colours for the attributes, worked out like in the window. */
+static void
+html_colours(export_job *j, uint attr, colour *fgp, colour *bgp)
+{
+  colour_i fgi = (attr & ATTR_FGMASK) >> ATTR_FGSHIFT;
+  colour_i bgi = (attr & ATTR_BGMASK) >> ATTR_BGSHIFT;
+  if (attr & ATTR_BOLD && j->bold_as_colour && fgi < 8)
+    fgi |= 8;
+  if (attr & ATTR_BLINK && bgi < 8)
+    bgi |= 8;
+  colour fg = j->colours[fgi], bg = j->colours[bgi];
+  if (attr & ATTR_DIM)
+    fg = ((fg & 0xFEFEFE) >> 1) + ((bg & 0xFEFEFE) >> 1);
+  if (attr & ATTR_REVERSE) {
+    colour t = fg; fg = bg; bg = t;
+  }
+  if (attr & ATTR_INVISIBLE)
+    fg = bg;
+  *fgp = fg;
+  *bgp = bg;
+}
+
+static void
+put_span(export_job *j, uint attr)
+{
+  if (j->attr != ATTR_DEFAULT)
+    put_str(j, "</span>");
+  if (attr == ATTR_DEFAULT)
+    return;
+  colour fg, bg;
+  html_colours(j, attr, &fg, &bg);
+  char *p = room(j, 128);
+  p += sprintf(p, "<span style=\"color:#%02x%02x%02x;background:#%02x%02x%02x",
+               red(fg), green(fg), blue(fg), red(bg), green(bg), blue(bg));
+  if (attr & ATTR_BOLD)
+    p += sprintf(p, ";font-weight:bold");
+  if (attr & ATTR_UNDER)
+    p += sprintf(p, ";text-decoration:underline");
+  p += sprintf(p, "\">");
+  j->len = p - j->out;
+}
+
+static void
+set_attr(export_job *j, uint attr)
+{
+  if (attr == j->attr)
+    return;
+  if (j->format == EXPORT_ANSI)
+    put_sgr(j, attr);
+  else if (j->format == EXPORT_HTML)
+    put_span(j, attr);
+  j->attr = attr;
+}
+
+static void
+put_char(export_job *j, wchar c, wchar *hs)
+{
+  string entity = null;
+  if (j->format == EXPORT_HTML) {
+    switch (c) {
+      when '&': entity = "&amp;";
+      when '<': entity = "&lt;";
+      when '>': entity = "&gt;";
+    }
+  }
+  if (entity)
+    put_str(j, entity);
+  else
+    j->len = put_utf16(room(j, 8), c, hs) - j->out;
+}
+
+static void
+put_line(export_job *j, termline *line)
+{
+  int cols = line->cols;
+  bool wrapped = line->attr & LATTR_WRAPPED;
+  if (wrapped && line->attr & LATTR_WRAPPED2)
+    cols--;
+  else if (!wrapped) {
+    // Leave out trailing blanks, unless their attributes show.
+    uint shows = j->format == EXPORT_TEXT ? 0 : EXPORT_ATTRS & ~ATTR_FGMASK;
+    while (cols > 0) {
+      termchar *c = &line->chars[cols - 1];
+      if (c->chr != ' ' || c->cc_next ||
+          (c->attr & shows) != (ATTR_DEFAULT & shows))
+        break;
+      cols--;
+    }
+  }
+
+  for (int x = 0; x < cols; x++) {
+    termchar *c = &line->chars[x];
+    if (c->chr == UCSWIDE)
+      continue;
+    if (j->format != EXPORT_TEXT)
+      set_attr(j, c->attr & EXPORT_ATTRS);
+    wchar hs = 0;
+    put_char(j, c->chr, &hs);
+    while (c->cc_next) {
+      c += c->cc_next;
+      put_char(j, c->chr, &hs);
+    }
+    if (hs)
+      j->len = put_utf8(room(j, 4), hs) - j->out;
+  }
+
+  if (!wrapped) {
+    // Attributes don't carry over to the next line in ANSI output, so
+    // that the file can be looked at a part at a time.
+    if (j->format == EXPORT_ANSI)
+      set_attr(j, ATTR_DEFAULT);
+    *room(j, 1) = '\n';
+    j->len++;
+  }
+  __sync_fetch_and_add(&j->done, 1);
+}
+
+static void
+put_lines(export_job *j, uchar *data, uint *ends, uint first, uint last)
+{
+  for (uint i = first; i < last && !j->error; i++) {
+    termline *line = decompressline(data + (i ? ends[i - 1] : 0), null);
+    resizeline(line, j->cols);
+    put_line(j, line);
+    freeline(line);
+  }
+}
+
+static void *
+export_thread(void *arg)
+{
+  export_job *j = arg;
+  j->attr = ATTR_DEFAULT;
+  if (j->head)
+    put_str(j, j->head);
+
+  sbbuffer buf = {.stored = null};
+  long long n = j->start;
+  while (n < j->end && !j->error) {
+    uchar *data;
+    uint *ends, lines;
+    long long first = scrollback_read(n, &buf, &data, &ends, &lines);
+    // The rest may have been evicted while we were at it.
+    if (first < 0 || first >= j->end)
+      break;
+    long long last = min(first + lines, j->end);
+    put_lines(j, data, ends, max(n, first) - first, last - first);
+    n = last;
+  }
+  scrollback_free_buffer(&buf);
+
+  put_lines(j, j->screen, j->screen_ends, 0, j->rows);
+  set_attr(j, ATTR_DEFAULT);
+  if (j->format == EXPORT_HTML)
+    put_str(j, "</pre>\n</body>\n</html>\n");
+  flush(j);
+  if (close(j->fd) < 0 && !j->error)
+    j->error = errno;
+
+  __sync_synchronize();
+  j->finished = true;
+  return 0;
+}
+
+static void
+check_export(void)
+{
+  export_job *j = job;
+  if (!j->finished) {
+    win_show_progress(j->total ? (long long)j->done * 100 / j->total : 0);
+    win_set_timer(check_export, EXPORT_TICKS);
+    return;
+  }
+
+  pthread_join(thread, null);
+  scrollback_share(false);
+  win_show_progress(-1);
+  if (j->error) {
+    char *msg;
+    int len = asprintf(&msg, "Could not export the scrollback:\n%s.",
+                       strerror(j->error));
+    if (len > 0) {
+      wchar wmsg[len + 1];
+      if (cs_mbstowcs(wmsg, msg, lengthof(wmsg)) >= 0)
+        win_show_error(wmsg);
+      delete(msg);
+    }
+  }
+  free(j->screen);
+  free(j->screen_ends);
+  free(j->head);
+  free(j->out);
+  delete(j);
+  job = null;
+}
+
+/*
+ * Start writing the scrollback and the screen to a file in the given
+ * format. The file descriptor is closed when done. Returns false if an
+ * export is already under way.
+ */
+bool
+term_export(int fd, export_format format)
+{
+  if (job)
+    return false;
+
+  export_job *j = new(export_job);
+  *j = (export_job){.fd = fd, .format = format};
+
+  // Take a copy of the screen as it is now, leaving out blank lines at
+  // the end.
+  int rows = term.rows;
+  while (rows > 0) {
+    termline *line = fetch_line(rows - 1);
+    bool blank = true;
+    for (int x = 0; x < line->cols && blank; x++)
+      blank = termchars_equal(&line->chars[x], &term.erase_char);
+    release_line(line);
+    if (!blank)
+      break;
+    rows--;
+  }
+  uchar *buf = null;
+  uint bufsize = 0, used = 0;
+  j->screen_ends = newn(uint, max(rows, 1));
+  for (int y = 0; y < rows; y++) {
+    termline *line = fetch_line(y);
+    uint len = compressline(line, &buf, &bufsize);
+    release_line(line);
+    j->screen = renewn(j->screen, used + len);
+    memcpy(j->screen + used, buf, len);
+    used += len;
+    j->screen_ends[y] = used;
+  }
+  free(buf);
+  j->rows = rows;
+  j->cols = term.cols;
+
+  // The alternate screen doesn't have a scrollback.
+  j->end = line_number(0);
+  j->start = sblines() ? line_number(-term.sblines) : j->end;
+  j->total = j->end - j->start + rows;
+
+  if (format == EXPORT_HTML) {
+    for (int i = 0; i < COLOUR_NUM; i++)
+      j->colours[i] = win_get_colour(i);
+    j->bold_as_colour = cfg.bold_as_colour;
+    colour fg = j->colours[FG_COLOUR_I], bg = j->colours[BG_COLOUR_I];
+    char *font = css_font_name(cfg.font.name);
+    if (asprintf(&j->head,
+          "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n"
+          "<title>%s</title>\n</head>\n<body>\n"
+          "<pre style=\"font-family:'%s',monospace;"
+          "color:#%02x%02x%02x;background:#%02x%02x%02x\">",
+          APPNAME, font,
+          red(fg), green(fg), blue(fg), red(bg), green(bg), blue(bg)) < 0)
+      j->head = null;
+    free(font);
+  }
+
+  j->out = newn(char, EXPORT_BUF_SIZE);
+  scrollback_share(true);
+  if (pthread_create(&thread, null, export_thread, j)) {
+    scrollback_share(false);
+    close(fd);
+    free(j->screen);
+    free(j->screen_ends);
+    free(j->head);
+    free(j->out);
+    delete(j);
+    return false;
+  }
+  job = j;
+  win_set_timer(check_export, EXPORT_TICKS);
+  return true;
+}
+
+bool
+term_exporting(void)
+{ return job; }
@@ -10,11 +10,13 @@ newline(int cols, int bce)
 {
   termline *line = new(termline);
   line->chars = newn(termchar, cols);
-  for (int j = 0; j < cols; j++)
-    line->chars[j] = (bce ? term.erase_char : basic_erase_char);
+  line->chars[0] = (bce ? term.erase_char : basic_erase_char);
   line->cols = line->size = cols;
   line->attr = LATTR_NORM;
   line->temporary = false;
+  line->blank = true;
+  line->dirty_lo = 0;
+  line->dirty_hi = cols;
   line->cc_free = 0;
   return line;
 }
@@ -354,14 +356,12 @@ readliteral_cc(struct buf *b, termchar *c, termline *line)
 }
 
 static void
-makerle(struct buf *b, termline *line,
+makerle(struct buf *b, termline *line, int n,
         void (*makeliteral) (struct buf *b, termchar *c))
 {
-  int hdrpos, hdrsize, n, prevlen, prevpos, thislen, thispos, prev2;
+  int hdrpos, hdrsize, prevlen, prevpos, thislen, thispos, prev2;
   termchar *c = line->chars;
 
-  n = line->cols;
-
   hdrpos = b->len;
   hdrsize = 0;
   add(b, 0);
@@ -487,11 +487,142 @@ makerle(struct buf *b, termline *line,
   }
 }
 
+/*
+ * Equivalent of makerle() for literals that are all one byte long: either
+ * the characters of a line, if they all have one-byte codes, or the zero
+ * bytes that encode the absence of combining characters. This produces
+ * exactly the same output, but saves encoding and comparing each literal
+ * in the buffer.
+ */
+static void
+makerle_bytes(struct buf *b, termchar *c, int n, bool zeros)
+{
+  int hdrpos = b->len, hdrsize = 0;
+  add(b, 0);
+  int prev = -1;  /* previous literal, or -1 if a run can't start there */
+  bool prev2 = false;
+
+  while (n-- > 0) {
+    uchar lit = zeros ? 0 : c++->chr;
+    add(b, lit);
+    if (lit == prev && prev2) {
+     /*
+      * Three identical literals. Turn them into a run, overwriting the
+      * header if they are all there is in the current sequence.
+      */
+      hdrsize -= 2;
+      int runpos = b->len - 3;
+      if (hdrsize == 0)
+        runpos = hdrpos;
+      else
+        b->data[hdrpos] = hdrsize - 1;
+      b->data[runpos + 1] = lit;
+      b->len = runpos + 2;
+
+      int runlen = 3;
+      while (n > 0 && runlen < 129 && (zeros ? 0 : c->chr) == lit) {
+        n--, runlen++;
+        if (!zeros)
+          c++;
+      }
+      b->data[runpos] = runlen + 0x80 - 2;
 
-uchar *
-compressline(termline *line)
+      hdrpos = b->len;
+      hdrsize = 0;
+      add(b, 0);
+      prev = -1;
+      prev2 = false;
+      continue;
+    }
+    prev2 = lit == prev;
+    prev = lit;
+    if (++hdrsize == 128) {
+      b->data[hdrpos] = hdrsize - 1;
+      hdrpos = b->len;
+      hdrsize = 0;
+      add(b, 0);
+      prev = -1;
+      prev2 = false;
+    }
+  }
+
+  if (hdrsize > 0)
+    b->data[hdrpos] = hdrsize - 1;
+  else
+    b->len = hdrpos;
+}
+
+/*
+ * Equivalent of makerle() with makeliteral_attr(). Attribute literals are
+ * at least two bytes long, so makerle() turns any two equal ones into a
+ * run, except that a literal that completes a sequence of 128 stays in
+ * it. Comparing the attributes directly saves encoding each of them.
+ */
+static void
+makerle_attr(struct buf *b, termchar *c, int n)
 {
-  struct buf buffer = { null, 0, 0 }, *b = &buffer;
+  int hdrpos = 0, hdrsize = 0;
+  while (n > 0) {
+    int runlen = 1;
+    if (hdrsize != 127) {
+      while (runlen < min(n, 129) && c[runlen].attr == c->attr)
+        runlen++;
+    }
+    if (runlen > 1) {
+      if (hdrsize) {
+        b->data[hdrpos] = hdrsize - 1;
+        hdrsize = 0;
+      }
+      add(b, runlen + 0x80 - 2);
+    }
+    else {
+      if (!hdrsize) {
+        hdrpos = b->len;
+        add(b, 0);
+      }
+      if (++hdrsize == 128) {
+        b->data[hdrpos] = hdrsize - 1;
+        hdrsize = 0;
+      }
+    }
+    makeliteral_attr(b, c);
+    c += runlen;
+    n -= runlen;
+  }
+  if (hdrsize)
+    b->data[hdrpos] = hdrsize - 1;
+}
+
+
+/*
+ * Compress a line into the buffer at *data, which is reallocated as
+ * needed, with its allocated size kept in *size. Returns the length of
+ * the compressed line.
+ */
+uint
+compressline(termline *line, uchar **data, uint *size)
+{
+  struct buf buffer = { *data, 0, *size }, *b = &buffer;
+
+  if (line->blank)
+    fillline(line);
+
+ /*
+  * Blanks at the end of the line are left out altogether, as
+  * resizeline() restores them. Also check whether the faster encoders
+  * for characters and combining characters can be used.
+  */
+  termchar *chars = line->chars;
+  int cols = line->cols;
+  while (cols > 0 && chars[cols - 1].chr == ' ' &&
+         chars[cols - 1].attr == ATTR_DEFAULT && !chars[cols - 1].cc_next)
+    cols--;
+  bool one_byte_chrs = true, no_cc = true;
+  for (int i = 0; i < cols; i++) {
+    wchar wc = chars[i].chr;
+    one_byte_chrs &= wc == 0 || (wc >= 0x20 && wc < 0x7F);
+    no_cc &= !chars[i].cc_next;
+  }
 
  /*
   * First, store the column count, 7 bits at a time, least
@@ -499,7 +630,7 @@ compressline(termline *line)
   * the last.
   */
   {
-    int n = line->cols;
+    int n = cols;
     while (n >= 128) {
       add(b, (uchar) ((n & 0x7F) | 0x80));
       n >>= 7;
@@ -532,19 +663,47 @@ compressline(termline *line)
   * 
   * The format of the `literals' varies between the fragments.
   */
-  makerle(b, line, makeliteral_chr);
-  makerle(b, line, makeliteral_attr);
-  makerle(b, line, makeliteral_cc);
+  if (one_byte_chrs)
+    makerle_bytes(b, chars, cols, false);
+  else
+    makerle(b, line, cols, makeliteral_chr);
+  makerle_attr(b, chars, cols);
+  if (no_cc)
+    makerle_bytes(b, chars, cols, true);
+  else
+    makerle(b, line, cols, makeliteral_cc);
 
- /*
-  * Trim the allocated memory so we don't waste any, and return.
-  */
-  return renewn(b->data, b->len);
+  *data = b->data;
+  *size = b->size;
+  return b->len;
+}
+
+static void
+copyliteral_chr(termline *line, int x, int src)
+{
+  line->chars[x].chr = line->chars[src].chr;
+}
+
+static void
+copyliteral_attr(termline *line, int x, int src)
+{
+  line->chars[x].attr = line->chars[src].attr;
+}
+
+static void
+copyliteral_cc(termline *line, int x, int src)
+{
+ /* Indices, because add_cc() may move the line's characters. */
+  while (line->chars[src].cc_next) {
+    src += line->chars[src].cc_next;
+    add_cc(line, x, line->chars[src].chr);
+  }
 }
 
 static void
 readrle(struct buf *b, termline *line,
-        void (*readliteral) (struct buf *b, termchar *c, termline *line))
+        void (*readliteral) (struct buf *b, termchar *c, termline *line),
+        void (*copyliteral) (termline *line, int x, int src))
 {
   int n = 0;
 
@@ -552,15 +711,14 @@ readrle(struct buf *b, termline *line,
     int hdr = get(b);
 
     if (hdr >= 0x80) {
-     /* A run. */
-
-      int pos = b->len, count = hdr + 2 - 0x80;
-      while (count--) {
-        assert(n < line->cols);
-        b->len = pos;
-        readliteral(b, line->chars + n, line);
-        n++;
-      }
+     /* A run. Read the literal once and copy it. */
+
+      int count = hdr + 2 - 0x80;
+      assert(n + count <= line->cols);
+      int first = n;
+      readliteral(b, line->chars + first, line);
+      while (++n, --count)
+        copyliteral(line, n, first);
     }
     else {
      /* Just a sequence of consecutive literals. */
@@ -604,6 +762,9 @@ decompressline(uchar *data, int *bytes_used)
   line->chars = newn(termchar, ncols);
   line->cols = line->size = ncols;
   line->temporary = true;
+  line->blank = false;
+  line->dirty_lo = 0;
+  line->dirty_hi = ncols;
   line->cc_free = 0;
 
  /*
@@ -631,9 +792,9 @@ decompressline(uchar *data, int *bytes_used)
  /*
   * Now we read in each of the RLE streams in turn.
   */
-  readrle(b, line, readliteral_chr);
-  readrle(b, line, readliteral_attr);
-  readrle(b, line, readliteral_cc);
+  readrle(b, line, readliteral_chr, copyliteral_chr);
+  readrle(b, line, readliteral_attr, copyliteral_attr);
+  readrle(b, line, readliteral_cc, copyliteral_cc);
 
  /* Return the number of bytes read, for diagnostic purposes. */
   if (bytes_used)
@@ -649,13 +810,30 @@ void
 clearline(termline *line)
 {
   line->attr = LATTR_NORM;
-  for (int j = 0; j < line->cols; j++)
-    line->chars[j] = term.erase_char;
   if (line->size > line->cols) {
     line->size = line->cols;
     line->chars = renewn(line->chars, line->size);
     line->cc_free = 0;
   }
+ /*
+  * Only the first column is set here. The rest of the line is filled in
+  * by fillline() when its characters are actually needed, which saves
+  * the work for lines that are cleared again before then.
+  */
+  line->chars[0] = term.erase_char;
+  line->blank = true;
+  line_changed(line, 0, line->cols);
+}
+
+/*
+ * Fill in a line that was left blank by clearline().
+ */
+void
+fillline(termline *line)
+{
+  for (int j = 1; j < line->cols; j++)
+    line->chars[j] = line->chars[0];
+  line->blank = false;
 }
 
 /*
@@ -667,6 +845,9 @@ resizeline(termline *line, int cols)
   int oldcols = line->cols;
 
   if (cols > oldcols) {
+    if (line->blank)
+      fillline(line);
+    line_changed(line, 0, cols);
 
    /*
     * Leave the same amount of cc space as there was to begin with.
@@ -720,20 +901,18 @@ sblines(void)
 termline *
 fetch_line(int y)
 {
-  termlines *lines = term.show_other_screen ? term.other_lines : term.lines;
-
   termline *line;
   if (y >= 0) {
     assert(y < term.rows);
-    line = lines[y];
+    if (term.show_other_screen)
+      line = term.other_lines[ring_row(term.other_lines_origin, y)];
+    else
+      line = term_rawline(y);
+    if (line->blank)
+      fillline(line);
   }
   else {
-    assert(y < term.sblines);
-    y += term.sbpos;
-    if (y < 0)
-      y += term.sblen; // Scrollback has wrapped round
-    uchar *cline = term.scrollback[y];
-    line = decompressline(cline, null);
+    line = scrollback_fetch(y);
     resizeline(line, term.cols);
   }
 
@@ -796,6 +975,7 @@ term_bidi_cache_store(int line, termchar *lbefore, termchar *lafter,
       term.pre_bidi_cache[j].width = term.post_bidi_cache[j].width = -1;
       term.pre_bidi_cache[j].forward = term.post_bidi_cache[j].forward = null;
       term.pre_bidi_cache[j].backward = term.post_bidi_cache[j].backward = null;
+      term.pre_bidi_cache[j].plain = term.post_bidi_cache[j].plain = false;
       j++;
     }
   }
@@ -817,6 +997,7 @@ term_bidi_cache_store(int line, termchar *lbefore, termchar *lafter,
   memset(term.post_bidi_cache[line].forward, 0, width * sizeof (int));
   memset(term.post_bidi_cache[line].backward, 0, width * sizeof (int));
 
+  term.post_bidi_cache[line].plain = true;
   for (i = 0; i < width; i++) {
     int p = wcTo[i].index;
 
@@ -824,6 +1005,8 @@ term_bidi_cache_store(int line, termchar *lbefore, termchar *lafter,
 
     term.post_bidi_cache[line].backward[i] = p;
     term.post_bidi_cache[line].forward[p] = i;
+    if (p != i || wcTo[i].origwc != wcTo[i].wc)
+      term.post_bidi_cache[line].plain = false;
   }
 }
 
@@ -137,14 +137,15 @@ sel_spread_half(pos p, bool forward)
 static void
 sel_spread(void)
 {
-  term.sel_start = sel_spread_half(term.sel_start, false);
-  term.sel_end = sel_spread_half(term.sel_end, true);
+  term.sel_start = sel_abs(sel_spread_half(sel_rel(term.sel_start), false));
+  term.sel_end = sel_abs(sel_spread_half(sel_rel(term.sel_end), true));
   incpos(term.sel_end);
 }
 
 static void
-sel_drag(pos selpoint)
+sel_drag(pos p)
 {
+  selpos selpoint = sel_abs(p);
   term.selected = true;
   if (!term.sel_rect) {
    /*
@@ -175,8 +176,9 @@ sel_drag(pos selpoint)
 }
 
 static void
-sel_extend(pos selpoint)
+sel_extend(pos p)
 {
+  selpos selpoint = sel_abs(p);
   if (term.selected) {
     if (!term.sel_rect) {
      /*
@@ -210,7 +212,7 @@ sel_extend(pos selpoint)
   }
   else
     term.sel_anchor = selpoint;
-  sel_drag(selpoint);
+  sel_drag(p);
 }
 
 typedef enum {
@@ -351,7 +353,7 @@ term_mouse_click(mouse_button b, mod_keys mods, pos p, int count)
       term.mouse_state = MS_OPENING;
       term.selected = true;
       term.sel_rect = false;
-      term.sel_start = term.sel_end = term.sel_anchor = p;
+      term.sel_start = term.sel_end = term.sel_anchor = sel_abs(p);
       sel_spread();
       win_update();
     }
@@ -360,17 +362,18 @@ term_mouse_click(mouse_button b, mod_keys mods, pos p, int count)
       p = get_selpoint(box_pos(p));
       term.mouse_state = -count;
       term.sel_rect = alt;
+      term.sel_held = 0;
       if (b != MBT_LEFT || shift_or_ctrl)
         sel_extend(p);
       else if (count == 1) {
         term.selected = false;
-        term.sel_anchor = p;
+        term.sel_anchor = sel_abs(p);
       }
       else {
         // Double or triple-click: select whole word or line
         term.selected = true;
         term.sel_rect = false;
-        term.sel_start = term.sel_end = term.sel_anchor = p;
+        term.sel_start = term.sel_end = term.sel_anchor = sel_abs(p);
         sel_spread();
       }
       win_capture_mouse();
@@ -396,14 +399,19 @@ term_mouse_release(mouse_button b, mod_keys mods, pos p)
       if (term.selected && cfg.copy_on_select)
         term_copy();
       
-      // Flush any output held back during selection.
-      term_flush();
+      // If the view was only held still for the selection,
+      // go back to following the output.
+      if (term.sel_held && term.disptop == -term.sel_held) {
+        term.disptop = 0;
+        win_update();
+      }
       
       // "Clicks place cursor" implementation.
       if (!cfg.clicks_place_cursor || term.on_alt_screen || term.app_cursor_keys)
         return;
       
-      pos dest = term.selected ? term.sel_end : get_selpoint(box_pos(p));
+      pos dest =
+        term.selected ? sel_rel(term.sel_end) : get_selpoint(box_pos(p));
       
       static bool moved_previously;
       static pos last_dest;
@@ -484,7 +492,7 @@ term_mouse_move(mod_keys mods, pos p)
     }
     else   { 
       term.sel_scroll = 0;
-      if (p.x < 0 && p.y + term.disptop > term.sel_anchor.y)
+      if (p.x < 0 && line_number(p.y + term.disptop) > term.sel_anchor.y)
         bp = (pos){.y = p.y - 1, .x = term.cols - 1};
     }
     sel_drag(get_selpoint(bp));
@@ -13,11 +13,19 @@
 
 #include <sys/termios.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* This combines two characters into one value, for the purpose of pairing
  * any modifier byte and the final byte in escape sequences.
+ * CPAIR(CPAIR(x, y), z) matches two modifier bytes.
  */
 #define CPAIR(x, y) ((x) << 8 | (y))
 
+/* Milliseconds for which synchronized output may hold back painting. */
+#define SYNC_OUTPUT_TIMEOUT 150
+
 static const char primary_da[] = "\e[?1;2c";
 
 /*
@@ -103,7 +111,7 @@ insert_char(int n)
   term_check_boundary(curs->x, curs->y);
   if (dir < 0)
     term_check_boundary(curs->x + n, curs->y);
-  line = term.lines[curs->y];
+  line = term_line_span(curs->y, curs->x, term.cols);
   if (dir < 0) {
     for (int j = 0; j < m; j++)
       move_termchar(line, line->chars + curs->x + j,
@@ -151,7 +159,7 @@ write_tab(void)
     curs->x++;
   while (curs->x < term.cols - 1 && !term.tabs[curs->x]);
   
-  if ((term.lines[curs->y]->attr & LATTR_MODE) != LATTR_NORM) {
+  if ((term_rawline(curs->y)->attr & LATTR_MODE) != LATTR_NORM) {
     if (curs->x >= term.cols / 2)
       curs->x = term.cols / 2 - 1;
   }
@@ -186,7 +194,7 @@ write_char(wchar c, int width)
     return;
   
   term_cursor *curs = &term.curs;
-  termline *line = term.lines[curs->y];
+  termline *line = term_line_span(curs->y, curs->x - 2, curs->x + 2);
   void put_char(wchar c)
   {
     clear_cc(line, curs->x);
@@ -202,7 +210,7 @@ write_char(wchar c, int width)
       curs->y++;
     curs->x = 0;
     curs->wrapnext = false;
-    line = term.lines[curs->y];
+    line = term_line(curs->y);
   }
   if (term.insert && width > 0)
     insert_char(width);
@@ -241,7 +249,7 @@ write_char(wchar c, int width)
         else if (curs->y < term.rows - 1)
           curs->y++;
         curs->x = 0;
-        line = term.lines[curs->y];
+        line = term_line(curs->y);
        /* Now we must term_check_boundary again, of course. */
         term_check_boundary(curs->x, curs->y);
         term_check_boundary(curs->x + 2, curs->y);
@@ -280,6 +288,157 @@ write_char(wchar c, int width)
   }
 }
 
+/*
+ * Write a run of characters that all have the same width, 1 or 2, in the
+ * current attributes. The result is the same as calling write_char() for
+ * each of them, but the boundary checks and the wrap and scroll decisions
+ * are made once per line segment rather than per character.
+ */
+static void
+write_chars(const wchar *wcs, uint n, int width)
+{
+  term_cursor *curs = &term.curs;
+
+  if (term.insert || !curs->autowrap || term.cols < 2) {
+    while (n--)
+      write_char(*wcs++, width);
+    return;
+  }
+
+  uint attr = curs->attr;
+  while (n) {
+    if (curs->wrapnext) {
+      term_line(curs->y)->attr |= LATTR_WRAPPED;
+      write_linefeed();
+      curs->x = 0;
+    }
+
+    int x = curs->x;
+    if (width == 2 && x == term.cols - 1) {
+      // Let write_char() deal with a wide character that doesn't fit.
+      write_char(*wcs++, 2);
+      n--;
+      continue;
+    }
+
+    uint m = min(n, (uint)(term.cols - x) / width);
+    term_check_boundary(x, curs->y);
+    term_check_boundary(x + m * width, curs->y);
+
+    termline *line = term_line_span(curs->y, x, x + m * width);
+    termchar *tc = line->chars + x;
+    for (uint i = 0; i < m; i++) {
+      if (tc->cc_next)
+        clear_cc(line, tc - line->chars);
+      *tc++ = (termchar){.chr = wcs[i], .attr = attr};
+      if (width == 2) {
+        if (tc->cc_next)
+          clear_cc(line, tc - line->chars);
+        *tc++ = (termchar){.chr = UCSWIDE, .attr = attr};
+      }
+    }
+    wcs += m;
+    n -= m;
+
+    x += m * width;
+    if (x == term.cols) {
+      x--;
+      curs->wrapnext = true;
+    }
+    curs->x = x;
+  }
+}
+
+/*
+ * Write a run of printable ASCII characters.
+ */
+static void
+write_ascii(const char *s, uint len)
+{
+  wchar wcs[256];
+  while (len) {
+    uint n = min(len, lengthof(wcs));
+    for (uint i = 0; i < n; i++)
+      wcs[i] = s[i];
+    write_chars(wcs, n, 1);
+    s += n;
+    len -= n;
+  }
+}
+
+/*
+ * Return the length of the run of printable ASCII characters at the
+ * start of a buffer.
+ */
+static uint
+ascii_span(const char *s, uint len)
+{
+  uint i = 0;
+#ifdef __SSE2__
+  const __m128i lo = _mm_set1_epi8(0x1F), hi = _mm_set1_epi8(0x7F);
+  while (i + 16 <= len) {
+    // Bytes 0x80 and above are negative as signed chars and thus fail the
+    // first comparison.
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+    uint mask = _mm_movemask_epi8(ok);
+    if (mask != 0xFFFF)
+      return i + __builtin_ctz(~mask);
+    i += 16;
+  }
+#endif
+  while (i < len && (uchar)(s[i] - 0x20) < 0x5F)
+    i++;
+  return i;
+}
+
+/*
+ * Called when a linefeed is about to scroll the screen. Look ahead for
+ * further linefeeds separated only by text, carriage returns and tabs, as
+ * their scrolling can be done in one go. The cursor is then moved up so
+ * that the linefeeds themselves just move it back down.
+ *
+ * Batches are kept fairly small, because the recycled lines are cleared
+ * up front, and they should still be in the cache when text is written
+ * into them.
+ */
+static void
+scroll_ahead(const char *s, uint len)
+{
+  enum { MAX_BATCH = 16 };
+  int max_lines = min(term.marg_bot - term.marg_top, MAX_BATCH);
+  int lines = 0;
+  for (uint i = 0; i < len && lines < max_lines; i++) {
+    i += ascii_span(s + i, len - i);
+    if (i == len)
+      break;
+    uchar c = s[i];
+    if (c == '\n')
+      lines++;
+    else if (c < 0x20 ? c != '\r' && c != '\t' : c == 0x7F)
+      break;
+  }
+  if (lines > 1) {
+    term_do_scroll(term.marg_top, term.marg_bot, lines, true);
+    term.curs.y -= lines;
+  }
+}
+
+/*
+ * Whether runs of printable ASCII can bypass character decoding and
+ * charset translation.
+ */
+static bool
+ascii_fastpath(void)
+{
+  term_cursor *curs = &term.curs;
+  term_cset cset = curs->csets[curs->g1];
+  return
+    cs_ascii_compatible && !curs->oem_acs && !term.printing &&
+    !term.in_mb_char && !term.high_surrogate &&
+    (cset == CSET_ASCII || cset == CSET_OEM);
+}
+
 static void
 write_error(void)
 {
@@ -288,6 +447,146 @@ write_error(void)
   write_char(0x2592, 1);
 }
 
+/*
+ * Display width of a BMP character.
+ */
+static int
+char_width(wchar wc)
+{
+  #if HAS_LOCALES
+  return wcwidth(wc);
+  #else
+  return xcwidth(wc);
+  #endif
+}
+
+/*
+ * Apply the current character set to a BMP character.
+ */
+static wchar
+map_char(wchar wc)
+{
+  switch(term.curs.csets[term.curs.g1]) {
+    when CSET_LINEDRW:
+      if (0x60 <= wc && wc <= 0x7E)
+        wc = win_linedraw_chars[wc - 0x60];
+    when CSET_GBCHR:
+      if (wc == '#')
+        wc = 0xA3; // pound sign
+    otherwise: ;
+  }
+  return wc;
+}
+
+/*
+ * Write a printable character, applying the current character set and
+ * splitting non-BMP characters into surrogate pairs.
+ */
+static void
+write_ucschar(xchar xc)
+{
+  if (xc >= 0x10000) {
+    wchar hwc = high_surrogate(xc), lwc = low_surrogate(xc);
+    #if HAS_LOCALES
+    int width = wcswidth((wchar[]){hwc, lwc}, 2);
+    #else
+    int width = xcwidth(xc);
+    #endif
+    write_char(hwc, width);
+    write_char(lwc, 0);
+    return;
+  }
+
+  write_char(map_char(xc), char_width(xc));
+}
+
+/*
+ * Feed a byte to the built-in UTF-8 decoder. Like cs_mb1towc(), this
+ * returns 1 when a character is complete, -2 if more bytes are needed,
+ * and -1 on an encoding error. Overlong forms, surrogates and characters
+ * beyond U+10FFFF are rejected at the first byte that rules them out.
+ */
+static always_inline int
+utf8_step(uchar c, xchar *pxc)
+{
+  if (!term.utf8_need) {
+    if (c < 0x80) {
+      *pxc = c;
+      return 1;
+    }
+    if (c < 0xC2 || c > 0xF4)
+      return -1;
+    uint need = c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+    term.utf8_need = need;
+    term.utf8_char = c & (0x3F >> need);
+    term.utf8_lo = c == 0xE0 ? 0xA0 : c == 0xF0 ? 0x90 : 0x80;
+    term.utf8_hi = c == 0xED ? 0x9F : c == 0xF4 ? 0x8F : 0xBF;
+    return -2;
+  }
+  if (c < term.utf8_lo || c > term.utf8_hi) {
+    term.utf8_need = 0;
+    return -1;
+  }
+  term.utf8_char = term.utf8_char << 6 | (c & 0x3F);
+  term.utf8_lo = 0x80;
+  term.utf8_hi = 0xBF;
+  if (--term.utf8_need)
+    return -2;
+  *pxc = term.utf8_char;
+  return 1;
+}
+
+/*
+ * Decode and write UTF-8 text up to the next control character.
+ * Characters are decoded in batches before being written, with encoding
+ * errors marked in the batch so that they are reported in sequence.
+ * Returns the number of bytes consumed.
+ */
+static uint
+write_utf8(const char *buf, uint len)
+{
+  enum { UTF8_ERROR = 0xFFFFFFFF };
+  xchar xcs[256];
+  uint pos = 0, n;
+  do {
+    n = 0;
+    while (pos < len && n < lengthof(xcs)) {
+      uchar c = buf[pos];
+      bool in_mb_char = term.utf8_need;
+      if (!in_mb_char && (c < 0x20 || c == 0x7F))
+        break;
+      pos++;
+      switch (utf8_step(c, &xcs[n])) {
+        when 1:
+          n++;
+        when -1:
+          xcs[n++] = UTF8_ERROR;
+          if (in_mb_char)
+            pos--;
+      }
+    }
+    for (uint i = 0; i < n;) {
+      xchar xc = xcs[i++];
+      int width = xc < 0x10000 ? char_width(xc) : 0;
+      if (width > 0) {
+        // Pass on runs of BMP characters of the same width together.
+        wchar wcs[lengthof(xcs)];
+        uint k = 0;
+        wcs[k++] = map_char(xc);
+        while (i < n && xcs[i] < 0x10000 && char_width(xcs[i]) == width)
+          wcs[k++] = map_char(xcs[i++]);
+        write_chars(wcs, k, width);
+      }
+      else if (xc == UTF8_ERROR)
+        write_error();
+      else
+        write_ucschar(xc);
+    }
+  } while (n == lengthof(xcs));
+  term.in_mb_char = term.utf8_need;
+  return pos;
+}
+
 /* Process control character, returning whether it has been recognised. */
 static bool
 do_ctrl(char c)
@@ -326,6 +625,19 @@ do_ctrl(char c)
   return true;
 }
 
+/*
+ * Process a control character, or show it as a glyph if it has no function.
+ */
+static void
+write_ctrl(char c, wchar wc)
+{
+  if (!do_ctrl(wc) && c == wc) {
+    wc = cs_btowc_glyph(c);
+    if (wc != c)
+      write_char(wc, 1);
+  }
+}
+
 static void
 do_esc(uchar c)
 {
@@ -376,7 +688,7 @@ do_esc(uchar c)
       term.tabs[curs->x] = true;
     when CPAIR('#', '8'):    /* DECALN: fills screen with Es :-) */
       for (int i = 0; i < term.rows; i++) {
-        termline *line = term.lines[i];
+        termline *line = term_line(i);
         for (int j = 0; j < term.cols; j++) {
           line->chars[j] =
             (termchar){.cc_next = 0, .chr = 'E', .attr = ATTR_DEFAULT};
@@ -385,13 +697,13 @@ do_esc(uchar c)
       }
       term.disptop = 0;
     when CPAIR('#', '3'):  /* DECDHL: 2*height, top */
-      term.lines[curs->y]->attr = LATTR_TOP;
+      term_line(curs->y)->attr = LATTR_TOP;
     when CPAIR('#', '4'):  /* DECDHL: 2*height, bottom */
-      term.lines[curs->y]->attr = LATTR_BOT;
+      term_line(curs->y)->attr = LATTR_BOT;
     when CPAIR('#', '5'):  /* DECSWL: normal */
-      term.lines[curs->y]->attr = LATTR_NORM;
+      term_line(curs->y)->attr = LATTR_NORM;
     when CPAIR('#', '6'):  /* DECDWL: 2*width */
-      term.lines[curs->y]->attr = LATTR_WIDE;
+      term_line(curs->y)->attr = LATTR_WIDE;
     when CPAIR('(', 'A') or CPAIR('(', 'B') or CPAIR('(', '0'):
      /* GZD4: G0 designate 94-set */
       curs->csets[0] = c;
@@ -561,6 +873,15 @@ set_modes(bool state)
           term.vt220_keys = state;
         when 2004:       /* xterm bracketed paste mode */
           term.bracketed_paste = state;
+        when 2026:       /* Synchronized output */
+         /*
+          * Painting is held back until the mode is reset again, so that
+          * a frame is only shown once the application has finished
+          * drawing it. In case it never does, give up after a while.
+          */
+          if (state && !term.sync_output)
+            term.sync_output_end = get_tick_count() + SYNC_OUTPUT_TIMEOUT;
+          term.sync_output = state;
 
         /* Mintty private modes */
         when 7700:       /* CJK ambigous width reporting */
@@ -596,6 +917,57 @@ set_modes(bool state)
   }
 }
 
+/*
+ * Look up the state of a mode for DECRQM: 1 if set, 2 if reset, or 0 if
+ * not recognised.
+ */
+static int
+get_mode(bool private, int arg)
+{
+  bool state;
+  if (private) {
+    switch (arg) {
+      when 1:    state = term.app_cursor_keys;
+      when 3:    state = term.reset_132;
+      when 5:    state = term.rvideo;
+      when 6:    state = term.curs.origin;
+      when 7:    state = term.curs.autowrap;
+      when 9:    state = term.mouse_mode == MM_X10;
+      when 25:   state = term.cursor_on;
+      when 40:   state = term.deccolm_allowed;
+      when 47 or 1047 or 1049: state = term.on_alt_screen;
+      when 67:   state = term.backspace_sends_bs;
+      when 1000: state = term.mouse_mode == MM_VT200;
+      when 1002: state = term.mouse_mode == MM_BTN_EVENT;
+      when 1003: state = term.mouse_mode == MM_ANY_EVENT;
+      when 1004: state = term.report_focus;
+      when 1005: state = term.mouse_enc == ME_UTF8;
+      when 1006: state = term.mouse_enc == ME_XTERM_CSI;
+      when 1015: state = term.mouse_enc == ME_URXVT_CSI;
+      when 1061: state = term.vt220_keys;
+      when 2004: state = term.bracketed_paste;
+      when 2026: state = term.sync_output;
+      when 7700: state = term.report_ambig_width;
+      when 7727: state = term.app_escape_key;
+      when 7728: state = term.escape_sends_fs;
+      when 7766: state = term.show_scrollbar;
+      when 7783: state = term.shortcut_override;
+      when 7786: state = term.wheel_reporting;
+      when 7787: state = term.app_wheel;
+      otherwise: return 0;
+    }
+  }
+  else {
+    switch (arg) {
+      when 4:  state = term.insert;
+      when 12: state = !term.echoing;
+      when 20: state = term.newline_mode;
+      otherwise: return 0;
+    }
+  }
+  return state ? 1 : 2;
+}
+
 /*
  * dtterm window operations and xterm extensions.
  */
@@ -791,7 +1163,7 @@ do_csi(uchar c)
       int p = curs->x;
       term_check_boundary(curs->x, curs->y);
       term_check_boundary(curs->x + n, curs->y);
-      termline *line = term.lines[curs->y];
+      termline *line = term_line_span(curs->y, p, p + n);
       while (n--)
         line->chars[p++] = term.erase_char;
     }
@@ -820,6 +1192,10 @@ do_csi(uchar c)
       term.cursor_blinks = arg0 ? arg0 % 2 : -1;
       term.cursor_invalid = true;
       term_schedule_cblink();
+    when CPAIR('$', 'p'):  /* DECRQM: request ANSI mode */
+      child_printf("\e[%d;%d$y", arg0, get_mode(false, arg0));
+    when CPAIR(CPAIR('?', '$'), 'p'):  /* DECRQM: request DEC private mode */
+      child_printf("\e[?%d;%d$y", arg0, get_mode(true, arg0));
     when CPAIR('"', 'q'):  /* DECSCA: select character protection attribute */
       switch (arg0) {
         when 0 or 2: term.curs.attr &= ~ATTR_PROTECTED;
@@ -934,8 +1310,10 @@ do_cmd(void)
     when 701:  // Set/get locale (from urxvt).
       if (!strcmp(s, "?"))
         child_printf("\e]701;%s\e\\", cs_get_locale());
-      else
+      else {
         cs_set_locale(s);
+        term_clear_mb_char();
+      }
     when 7770:  // Change font size.
       if (!strcmp(s, "?"))
         child_printf("\e]7770;%u\e\\", win_get_font_size());
@@ -969,7 +1347,200 @@ do_cmd(void)
       *s = 0;
       child_printf("\e]7771;!%s\e\\", term.cmd_buf);
     }
+    when 7775:  // Report scrollback size.
+      if (!strcmp(s, "?")) {
+        long long memory, filed;
+        scrollback_usage(&memory, &filed);
+        child_printf("\e]7775;%d;%lld;%lld;%lld\e\\", term.sblines,
+                     memory, filed, (long long)cfg.scrollback_size << 10);
+      }
+  }
+}
+
+/*
+ * Actions for bytes received while in one of the escape sequence states.
+ */
+enum {
+  SA_NONE,        // Just change state
+  SA_CTRL,        // Control character within a sequence
+  SA_MOD,         // Intermediate or private modifier byte
+  SA_ESC,         // Final byte of an escape sequence
+  SA_CSI_DIGIT,   // Digit of a CSI argument
+  SA_CSI_SEP,     // Separator between CSI arguments
+  SA_CSI,         // Final byte of a control sequence
+  SA_CMD,         // Terminator of an OSC or DCS command string
+  SA_CMD_CHAR,    // Character of an OSC or DCS command string
+  SA_OSC,         // First character after OSC
+  SA_OSC_NUM,     // First digit of an OSC command number
+  SA_OSC_SEP,     // Separator right after OSC, denoting command 0
+  SA_OSC_DIGIT,   // Subsequent digit of an OSC command number
+  SA_PAL_RESET,   // Linux palette reset
+  SA_PAL_DIGIT,   // Digit of a Linux palette sequence
+  SA_PAL_END      // Unterminated end of a Linux palette sequence
+};
+
+/*
+ * Transition table for the escape sequence states, indexed by state and
+ * byte. Each entry gives the action to perform and the state to switch to
+ * beforehand, which actions may override. The NORMAL state is handled by
+ * the text path in term_write() and has no row.
+ */
+#define SEQ(action, state) {SA_##action, state}
+
+static const struct { uchar action, state; }
+seq_table[OSC_PALETTE + 1][256] = {
+  [ESCAPE] = {
+    [0x00 ... 0x1F] = SEQ(CTRL, ESCAPE),
+    [0x20 ... 0x2F] = SEQ(MOD, ESCAPE),
+    [0x30 ... 0xFF] = SEQ(ESC, NORMAL)
+  },
+  [CMD_ESCAPE] = {
+    [0x00 ... 0x1F] = SEQ(CTRL, CMD_ESCAPE),
+    [0x20 ... 0x2F] = SEQ(MOD, CMD_ESCAPE),
+    [0x30 ... 0x5B] = SEQ(ESC, NORMAL),
+    ['\\'] = SEQ(CMD, NORMAL),  // ST: string terminator
+    [0x5D ... 0xFF] = SEQ(ESC, NORMAL)
+  },
+  [CSI_ARGS] = {
+    [0x00 ... 0x1F] = SEQ(CTRL, CSI_ARGS),
+    [0x20 ... 0x2F] = SEQ(MOD, CSI_ARGS),
+    ['0' ... '9'] = SEQ(CSI_DIGIT, CSI_ARGS),
+    [':'] = SEQ(MOD, CSI_ARGS),
+    [';'] = SEQ(CSI_SEP, CSI_ARGS),
+    ['<' ... '?'] = SEQ(MOD, CSI_ARGS),
+    [0x40 ... 0xFF] = SEQ(CSI, NORMAL)
+  },
+  [OSC_START] = {
+    [0x00 ... 0x06] = SEQ(OSC, IGNORE_STRING),
+    ['\a'] = SEQ(OSC, NORMAL),
+    [0x08 ... 0x09] = SEQ(OSC, IGNORE_STRING),
+    ['\n'] = SEQ(OSC, NORMAL),
+    [0x0B ... 0x0C] = SEQ(OSC, IGNORE_STRING),
+    ['\r'] = SEQ(OSC, NORMAL),
+    [0x0E ... 0x1A] = SEQ(OSC, IGNORE_STRING),
+    ['\e'] = SEQ(OSC, ESCAPE),
+    [0x1C ... 0x2F] = SEQ(OSC, IGNORE_STRING),
+    ['0' ... '9'] = SEQ(OSC_NUM, OSC_NUM),  // OSC command number
+    [':'] = SEQ(OSC, IGNORE_STRING),
+    [';'] = SEQ(OSC_SEP, CMD_STRING),
+    ['<' ... 'O'] = SEQ(OSC, IGNORE_STRING),
+    ['P'] = SEQ(OSC, OSC_PALETTE),  // Linux palette sequence
+    ['Q'] = SEQ(OSC, IGNORE_STRING),
+    ['R'] = SEQ(PAL_RESET, NORMAL),  // Linux palette reset
+    ['S' ... 0xFF] = SEQ(OSC, IGNORE_STRING)
+  },
+  [OSC_NUM] = {
+    [0x00 ... 0x06] = SEQ(NONE, IGNORE_STRING),
+    ['\a'] = SEQ(NONE, NORMAL),
+    [0x08 ... 0x09] = SEQ(NONE, IGNORE_STRING),
+    ['\n'] = SEQ(NONE, NORMAL),
+    [0x0B ... 0x0C] = SEQ(NONE, IGNORE_STRING),
+    ['\r'] = SEQ(NONE, NORMAL),
+    [0x0E ... 0x1A] = SEQ(NONE, IGNORE_STRING),
+    ['\e'] = SEQ(NONE, ESCAPE),
+    [0x1C ... 0x2F] = SEQ(NONE, IGNORE_STRING),
+    ['0' ... '9'] = SEQ(OSC_DIGIT, OSC_NUM),
+    [':'] = SEQ(NONE, IGNORE_STRING),
+    [';'] = SEQ(NONE, CMD_STRING),
+    ['<' ... 0xFF] = SEQ(NONE, IGNORE_STRING)
+  },
+  [OSC_PALETTE] = {
+    [0x00 ... 0x06] = SEQ(PAL_END, NORMAL),
+    ['\a'] = SEQ(NONE, NORMAL),
+    [0x08 ... 0x2F] = SEQ(PAL_END, NORMAL),
+    ['0' ... '9'] = SEQ(PAL_DIGIT, OSC_PALETTE),
+    [':' ... '@'] = SEQ(PAL_END, NORMAL),
+    ['A' ... 'F'] = SEQ(PAL_DIGIT, OSC_PALETTE),
+    ['G' ... '`'] = SEQ(PAL_END, NORMAL),
+    ['a' ... 'f'] = SEQ(PAL_DIGIT, OSC_PALETTE),
+    ['g' ... 0xFF] = SEQ(PAL_END, NORMAL)
+  },
+  [CMD_STRING] = {
+    [0x00 ... 0x06] = SEQ(CMD_CHAR, CMD_STRING),
+    ['\a'] = SEQ(CMD, NORMAL),
+    [0x08 ... 0x09] = SEQ(CMD_CHAR, CMD_STRING),
+    ['\n'] = SEQ(NONE, NORMAL),
+    [0x0B ... 0x0C] = SEQ(CMD_CHAR, CMD_STRING),
+    ['\r'] = SEQ(NONE, NORMAL),
+    [0x0E ... 0x1A] = SEQ(CMD_CHAR, CMD_STRING),
+    ['\e'] = SEQ(NONE, CMD_ESCAPE),
+    [0x1C ... 0xFF] = SEQ(CMD_CHAR, CMD_STRING)
+  },
+  [IGNORE_STRING] = {
+    [0x00 ... 0x06] = SEQ(NONE, IGNORE_STRING),
+    ['\a'] = SEQ(NONE, NORMAL),
+    [0x08 ... 0x09] = SEQ(NONE, IGNORE_STRING),
+    ['\n'] = SEQ(NONE, NORMAL),
+    [0x0B ... 0x0C] = SEQ(NONE, IGNORE_STRING),
+    ['\r'] = SEQ(NONE, NORMAL),
+    [0x0E ... 0x1A] = SEQ(NONE, IGNORE_STRING),
+    ['\e'] = SEQ(NONE, ESCAPE),
+    [0x1C ... 0xFF] = SEQ(NONE, IGNORE_STRING)
+  }
+};
+
+#undef SEQ
+
+/*
+ * Process a byte received in one of the escape sequence states, returning
+ * whether it needs to be processed again in the new state.
+ */
+static bool
+do_seq(uchar c)
+{
+  uint action = seq_table[term.state][c].action;
+  term.state = seq_table[term.state][c].state;
+  switch (action) {
+    when SA_CTRL:
+      do_ctrl(c);
+    when SA_MOD:
+      term.esc_mod = term.esc_mod > 0xFF ? 0xFFFF : term.esc_mod << 8 | c;
+    when SA_ESC:
+      do_esc(c);
+    when SA_CSI_DIGIT: {
+      uint i = term.csi_argc - 1;
+      if (i < lengthof(term.csi_argv))
+        term.csi_argv[i] = 10 * term.csi_argv[i] + c - '0';
+    }
+    when SA_CSI_SEP:
+      if (term.csi_argc < lengthof(term.csi_argv))
+        term.csi_argc++;
+    when SA_CSI:
+      do_csi(c);
+    when SA_CMD:
+      do_cmd();
+    when SA_CMD_CHAR:
+      if (term.cmd_len < lengthof(term.cmd_buf) - 1)
+        term.cmd_buf[term.cmd_len++] = c;
+    when SA_OSC:
+      term.cmd_len = 0;
+    when SA_OSC_NUM:
+      term.cmd_len = 0;
+      term.cmd_num = c - '0';
+    when SA_OSC_SEP:
+      term.cmd_len = 0;
+      term.cmd_num = 0;
+    when SA_OSC_DIGIT:
+      term.cmd_num = term.cmd_num * 10 + c - '0';
+    when SA_PAL_RESET:
+      term.cmd_len = 0;
+      win_reset_colours();
+    when SA_PAL_DIGIT:
+      // The dodgy Linux palette sequence: keep going until we have
+      // seven hexadecimal digits.
+      term.cmd_buf[term.cmd_len++] = c;
+      if (term.cmd_len == 7) {
+        uint n, r, g, b;
+        sscanf(term.cmd_buf, "%1x%2x%2x%2x", &n, &r, &g, &b);
+        win_set_colour(n, make_colour(r, g, b));
+        term.state = NORMAL;
+      }
+    when SA_PAL_END:
+      // End of sequence. Put the character back, as the sequence was
+      // not terminated properly.
+      return true;
   }
+  return false;
 }
 
 void
@@ -985,41 +1556,37 @@ term_print_finish(void)
   }
 }
 
-/* Empty the input buffer */
-void
-term_flush(void)
-{
-  term_write(term.inbuf, term.inbuf_pos);
-  free(term.inbuf);
-  term.inbuf = 0;
-  term.inbuf_pos = 0;
-  term.inbuf_size = 0;
-}
-
 void
 term_write(const char *buf, uint len)
 {
- /*
-  * During drag-selects, we do not process terminal input,
-  * because the user will want the screen to hold still to
-  * be selected.
-  */
-  if (term_selecting()) {
-    if (term.inbuf_pos + len > term.inbuf_size) {
-      term.inbuf_size = max(term.inbuf_pos, term.inbuf_size * 4 + 4096);
-      term.inbuf = renewn(term.inbuf, term.inbuf_size);
-    }
-    memcpy(term.inbuf + term.inbuf_pos, buf, len);
-    term.inbuf_pos += len;
-    return;
-  }
-    
   // Reset cursor blinking.
   term.cblinker = 1;
   term_schedule_cblink();
 
   uint pos = 0;
   while (pos < len) {
+    if (term.state == NORMAL && ascii_fastpath()) {
+      uint n = ascii_span(buf + pos, len - pos);
+      if (n) {
+        write_ascii(buf + pos, n);
+        pos += n;
+        continue;
+      }
+    }
+    if (term.state == NORMAL && cs_utf8 && !term.curs.oem_acs &&
+        !term.printing) {
+      uint n = write_utf8(buf + pos, len - pos);
+      if (n) {
+        pos += n;
+        continue;
+      }
+    }
+
+    if (buf[pos] == '\n' && term.state == NORMAL &&
+        term.curs.y == term.marg_bot && !term.only_printing &&
+        !term.in_mb_char && !term.high_surrogate)
+      scroll_ahead(buf + pos, len - pos);
+
     uchar c = buf[pos++];
     
    /*
@@ -1066,6 +1633,26 @@ term_write(const char *buf, uint len)
           write_char(cs_btowc_glyph(c), 1);
           continue;
         }
+
+        if (cs_utf8) {
+          xchar xc;
+          switch (utf8_step(c, &xc)) {
+            when -1: // Encoding error
+              write_error();
+              if (term.in_mb_char)
+                pos--;
+              term.in_mb_char = false;
+            when -2: // Incomplete character
+              term.in_mb_char = true;
+            otherwise:
+              term.in_mb_char = false;
+              if (xc < 0x20 || xc == 0x7F)
+                write_ctrl(c, xc);
+              else
+                write_ucschar(xc);
+          }
+          continue;
+        }
         
         switch (cs_mb1towc(&wc, c)) {
           when 0: // NUL or low surrogate
@@ -1091,15 +1678,8 @@ term_write(const char *buf, uint len)
         term.high_surrogate = 0;
         
         if (is_low_surrogate(wc)) {
-          if (hwc) {
-            #if HAS_LOCALES
-            int width = wcswidth((wchar[]){hwc, wc}, 2);
-            #else
-            int width = xcwidth(combine_surrogates(hwc, wc));
-            #endif
-            write_char(hwc, width);
-            write_char(wc, 0);
-          }
+          if (hwc)
+            write_ucschar(combine_surrogates(hwc, wc));
           else
             write_error();
           continue;
@@ -1115,137 +1695,16 @@ term_write(const char *buf, uint len)
         
         // Control characters
         if (wc < 0x20 || wc == 0x7F) {
-          if (!do_ctrl(wc) && c == wc) {
-            wc = cs_btowc_glyph(c);
-            if (wc != c)
-              write_char(wc, 1);
-          }
+          write_ctrl(c, wc);
           continue;
         }
 
         // Everything else
-        #if HAS_LOCALES
-        int width = wcwidth(wc);
-        #else
-        int width = xcwidth(wc);
-        #endif
-        
-        switch(term.curs.csets[term.curs.g1]) {
-          when CSET_LINEDRW:
-            if (0x60 <= wc && wc <= 0x7E)
-              wc = win_linedraw_chars[wc - 0x60];
-          when CSET_GBCHR:
-            if (c == '#')
-              wc = 0xA3; // pound sign
-          otherwise: ;
-        }
-        write_char(wc, width);
+        write_ucschar(wc);
       }
-      when ESCAPE or CMD_ESCAPE:
-        if (c < 0x20)
-          do_ctrl(c);
-        else if (c < 0x30)
-          term.esc_mod = term.esc_mod ? 0xFF : c;
-        else if (c == '\\' && term.state == CMD_ESCAPE) {
-          /* Process DCS or OSC sequence if we see ST. */
-          do_cmd();
-          term.state = NORMAL;
-        }
-        else
-          do_esc(c);
-      when CSI_ARGS:
-        if (c < 0x20)
-          do_ctrl(c);
-        else if (c == ';') {
-          if (term.csi_argc < lengthof(term.csi_argv))
-            term.csi_argc++;
-        }
-        else if (c >= '0' && c <= '9') {
-          uint i = term.csi_argc - 1;
-          if (i < lengthof(term.csi_argv))
-            term.csi_argv[i] = 10 * term.csi_argv[i] + c - '0';
-        }
-        else if (c < 0x40)
-          term.esc_mod = term.esc_mod ? 0xFF : c;
-        else {
-          do_csi(c);
-          term.state = NORMAL;
-        }
-      when OSC_START:
-        term.cmd_len = 0;
-        switch (c) {
-          when 'P':  /* Linux palette sequence */
-            term.state = OSC_PALETTE;
-          when 'R':  /* Linux palette reset */
-            win_reset_colours();
-            term.state = NORMAL;
-          when '0' ... '9':  /* OSC command number */
-            term.cmd_num = c - '0';
-            term.state = OSC_NUM;
-          when ';':
-            term.cmd_num = 0;
-            term.state = CMD_STRING;
-          when '\a' or '\n' or '\r':
-            term.state = NORMAL;
-          when '\e':
-            term.state = ESCAPE;
-          otherwise:
-            term.state = IGNORE_STRING;
-        }
-      when OSC_NUM:
-        switch (c) {
-          when '0' ... '9':  /* OSC command number */
-            term.cmd_num = term.cmd_num * 10 + c - '0';
-          when ';':
-            term.state = CMD_STRING;
-          when '\a' or '\n' or '\r':
-            term.state = NORMAL;
-          when '\e':
-            term.state = ESCAPE;
-          otherwise:
-            term.state = IGNORE_STRING;
-        }
-      when OSC_PALETTE:
-        if (isxdigit(c)) {
-          // The dodgy Linux palette sequence: keep going until we have
-          // seven hexadecimal digits.
-          term.cmd_buf[term.cmd_len++] = c;
-          if (term.cmd_len == 7) {
-            uint n, r, g, b;
-            sscanf(term.cmd_buf, "%1x%2x%2x%2x", &n, &r, &g, &b);
-            win_set_colour(n, make_colour(r, g, b));
-            term.state = NORMAL;
-          }
-        }
-        else {
-          // End of sequence. Put the character back unless the sequence was 
-          // terminated properly.
-          term.state = NORMAL;
-          if (c != '\a') {
-            pos--;
-            continue;
-          }
-        }
-      when CMD_STRING:
-        switch (c) {
-          when '\n' or '\r':
-            term.state = NORMAL;
-          when '\a':
-            do_cmd();
-            term.state = NORMAL;
-          when '\e':
-            term.state = CMD_ESCAPE;
-          otherwise:
-            if (term.cmd_len < lengthof(term.cmd_buf) - 1)
-              term.cmd_buf[term.cmd_len++] = c;
-        }
-      when IGNORE_STRING:
-        switch (c) {
-          when '\n' or '\r' or '\a':
-            term.state = NORMAL;
-          when '\e':
-            term.state = ESCAPE;
-        }
+      otherwise:
+        if (do_seq(c))
+          pos--;  // Reprocess character
     }
   }
   win_schedule_update();
@@ -19,6 +19,147 @@
 #define posPlt(p1,p2) ((p1).y <= (p2).y && (p1).x < (p2).x)
 #define posPle(p1,p2) ((p1).y <= (p2).y && (p1).x <= (p2).x)
 
+/*
+ * The rows of each screen are kept in a ring that starts at
+ * term.lines_origin or term.other_lines_origin respectively, so that
+ * scrolling the whole screen only needs to move the origin.
+ */
+static inline int
+ring_row(int origin, int y)
+{
+  int i = origin + y;
+  return i < term.rows ? i : i - term.rows;
+}
+
+/* Row of the current screen that may still be blank (see clearline()). */
+static inline termline *
+term_rawline(int y)
+{ return term.lines[ring_row(term.lines_origin, y)]; }
+
+/*
+ * Record that columns `from' up to (but excluding) `to' of a line have
+ * changed, so that term_paint() looks at them again.
+ */
+static inline void
+line_changed(termline *line, int from, int to)
+{
+  if (from < line->dirty_lo)
+    line->dirty_lo = max(from, 0);
+  if (to > line->dirty_hi)
+    line->dirty_hi = to;
+}
+
+/* Row of the current screen, ready for changing columns `from' to `to'. */
+static inline termline *
+term_line_span(int y, int from, int to)
+{
+  termline *line = term_rawline(y);
+  if (line->blank)
+    fillline(line);
+  line_changed(line, from, to);
+  return line;
+}
+
+/* Row of the current screen, ready for changing any of it. */
+static inline termline *
+term_line(int y)
+{ return term_line_span(y, 0, term.cols); }
+
+/* Characters are compared case-insensitively in searches. */
+static inline wchar
+fold_char(wchar c)
+{
+  if (c < 0x80)
+    return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+  return towlower(c);
+}
+
+/*
+ * Hash of three folded characters in a row, for scrollback summaries.
+ * The low five bits of each character count most, so that the key can
+ * be kept up to date cheaply while going along a line: key << 5 ^ c.
+ */
+static inline uint
+trigram_hash(uint key)
+{ return (key & 0x7FFF) * 0x9E3779B1u; }
+
+static inline uint
+trigram(wchar c1, wchar c2, wchar c3)
+{ return trigram_hash((uint)c1 << 10 ^ (uint)c2 << 5 ^ c3); }
+
+/* Convert a character to UTF-8. */
+static inline char *
+put_utf8(char *p, xchar c)
+{
+  if (c < 0x80)
+    *p++ = c;
+  else if (c < 0x800) {
+    *p++ = 0xC0 | c >> 6;
+    *p++ = 0x80 | (c & 0x3F);
+  }
+  else if (c < 0x10000) {
+    *p++ = 0xE0 | c >> 12;
+    *p++ = 0x80 | (c >> 6 & 0x3F);
+    *p++ = 0x80 | (c & 0x3F);
+  }
+  else {
+    *p++ = 0xF0 | c >> 18;
+    *p++ = 0x80 | (c >> 12 & 0x3F);
+    *p++ = 0x80 | (c >> 6 & 0x3F);
+    *p++ = 0x80 | (c & 0x3F);
+  }
+  return p;
+}
+
+/*
+ * Convert UTF-16 to UTF-8. Surrogate pairs may be split across calls,
+ * with *hs holding a high surrogate waiting for its partner.
+ */
+static inline char *
+put_utf16(char *p, wchar c, wchar *hs)
+{
+  if (*hs) {
+    if ((c & 0xFC00) == 0xDC00) {
+      p = put_utf8(p, 0x10000 + ((*hs & 0x3FF) << 10 | (c & 0x3FF)));
+      *hs = 0;
+      return p;
+    }
+    p = put_utf8(p, *hs);
+    *hs = 0;
+  }
+  if ((c & 0xFC00) == 0xD800)
+    *hs = c;
+  else
+    p = put_utf8(p, c);
+  return p;
+}
+
+/* Buffers for reading scrollback blocks from another thread. */
+typedef struct {
+  uchar *stored, *unpacked, *resolved;
+  uint stored_size, unpacked_size, resolved_size;
+} sbbuffer;
+
+termline *scrollback_push(termline *);
+termline *scrollback_pop(void);
+termline *scrollback_fetch(int y);
+termline *scrollback_peek(int y);
+void scrollback_prefetch(int y, int rows);
+long long line_number(int y);
+void scrollback_uncache(void);
+void scrollback_usage(long long *memory, long long *filed);
+bool scrollback_may_contain(long long n, const uint *trigrams, int ntrigrams);
+void scrollback_scan(const uint *trigrams, int ntrigrams,
+                     void (*fn)(void *arg, long long n, termline *line),
+                     void **args, int nthreads);
+void scrollback_share(bool);
+long long scrollback_read(long long n, sbbuffer *,
+                          uchar **data, uint **ends, uint *lines);
+void scrollback_free_buffer(sbbuffer *);
+
+bool search_update(void);
+bool search_marks(termline *, bool *marks);
+
 void term_print_finish(void);
 
 void term_schedule_tblink(void);
@@ -30,11 +171,28 @@ void term_check_boundary(int x, int y);
 void term_do_scroll(int topline, int botline, int lines, bool sb);
 void term_erase(bool selective, bool line_only, bool from_begin, bool to_end);
 int  term_last_nonempty_line(void);
+void disprows_invalidate(int top, int bottom);
 
 static inline bool
 term_selecting(void)
 { return term.mouse_state < 0 && term.mouse_state >= MS_SEL_LINE; }
 
+/* Convert between screen positions and the absolute ones of the selection.
+ * Lines that have been evicted from the scrollback map to its start. */
+static inline selpos
+sel_abs(pos p)
+{ return (selpos){.y = line_number(p.y), .x = p.x}; }
+
+static inline pos
+sel_rel(selpos p)
+{
+  long long y = p.y - line_number(0);
+  if (y < -term.sblines)
+    return (pos){.y = -term.sblines, .x = 0};
+  return (pos){.y = min(y, term.rows), .x = p.x};
+}
+
 void term_update_cs(void);
+void term_clear_mb_char(void);
 
 #endif
@@ -0,0 +1,2213 @@
+// termsb.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "termpriv.h"
+
+#include "lz.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+/*
+ * Scrollback storage.
+ *
+ * The newest lines are kept as they are, as the screen lines that
+ * scrolled off, in what is called the hot tier here. Scrolling back a
+ * little or selecting across the top of the screen then doesn't have to
+ * decompress anything, and lines only get compressed once they age out of
+ * the hot tier. The screen gets lines that have aged out to reuse in
+ * return for the ones that scroll off.
+ *
+ * Lines that age out are compressed by a thread of its own, so that the
+ * terminal doesn't have to wait for that while output is streaming in.
+ * They are handed to it through a queue (see queue_line()), and remain
+ * part of the hot tier until the terminal thread puts the compressed
+ * lines into the blocks.
+ *
+ * Rather than keeping each compressed line in a heap block of its own,
+ * lines are appended to large blocks, each of which records where its
+ * lines end. Lines are numbered in the order they were pushed, and each
+ * block knows the number of its first line, so a line is found with a
+ * binary search over the blocks. Evicting the oldest lines frees whole
+ * blocks once all their lines are gone, and clearing the scrollback only
+ * has to free the blocks.
+ *
+ * Once a block is full, it is sealed and packed with the LZ codec, which
+ * catches the repetition across lines that the line compression can't.
+ * Packed blocks are unpacked on demand into a small cache.
+ *
+ * With the ScrollbackFile setting, sealed blocks are moved to an unnamed
+ * temporary file, which is divided into segments that are mapped into
+ * memory when needed. This leaves it to the system to decide how much of
+ * the scrollback stays in memory. Segments are reused once all their
+ * blocks have been evicted. Blocks can also be saved to a session file,
+ * which is used like the spill file when they are restored from it.
+ *
+ * Recently fetched lines are kept in decompressed form in an LRU cache, so
+ * that painting or selecting the same part of the scrollback over and over
+ * doesn't decompress it every time. When a jump leaves many rows to be
+ * decompressed, they are decoded on several threads at once and put into
+ * the cache before painting (see scrollback_prefetch()).
+ *
+ * Finally, each block has a summary of the text in it, in the form of a
+ * Bloom filter of the trigrams in its lines (see trigram()). Searches use
+ * it to skip blocks that can't contain a match.
+ *
+ * The number of bytes taken up by the blocks is tracked, both in memory
+ * and in the spill file, so that the scrollback can be kept within the
+ * ScrollbackSize setting as well as ScrollbackLines. As freeing memory
+ * means freeing blocks, that limit is enforced by evicting whole blocks.
+ *
+ * Lines that keep coming back, such as the same log message over and
+ * over, are stored only once, and referred to from the blocks (see
+ * share_line()).
+ *
+ * Another thread can read the scrollback while it's shared (see
+ * scrollback_share()), in which case changes to it are made under a lock.
+ */
+
+#define SB_BLOCK_SIZE 65536
+#define SPILL_SEGMENT_SIZE (32 << 20)
+#define SPILL_MAPPED_MAX 16
+#define SB_CACHE_SIZE 1024
+#define SB_DECODE_THREADS 4  /* most threads for decoding rows at once */
+#define SB_DECODE_MIN 32     /* fewest missing rows worth decoding that way */
+#define SB_HOT_LINES 1024
+#define SB_QUEUE_LINES 1024  /* lines waiting for compression, power of 2 */
+#define SB_BATCH 64          /* lines the compression thread wakes up for */
+#define SB_SUMMARY_BITS 14  /* log2 of the number of bits in a summary */
+#define SB_SHARE_MIN 16     /* shortest compressed line worth sharing */
+#define SB_RECENT_SIZE 16384  /* recent lines checked for repeats */
+#define SB_RECENT_BYTES (1 << 20)  /* size of their copies */
+
+typedef struct {
+  long long first;  /* number of the first line in the block */
+  uint lines;       /* number of lines in the block */
+  uint used, size;  /* bytes of data used and allocated when unpacked */
+  uint packed;      /* size of the LZ packed data, or 0 if not packed */
+  uint *ends;       /* offset after the end of each line */
+  uint ends_size;
+  uchar *data;
+  long long spilled;  /* position in the spill file, or -1 */
+  bool restored;    /* spilled to the session file instead */
+  bool checked;     /* restored and found to be intact */
+  uint check;       /* when restored, see block_check() */
+  uint *summary;    /* Bloom filter of the trigrams in the lines */
+  uint refs;        /* number of lines that refer to shared lines */
+} sbblock;
+
+static struct {
+  sbblock **blocks;  /* oldest first */
+  int nblocks, size;
+  long long end;     /* number after that of the newest line */
+  uchar *buf;        /* buffer for compressing lines */
+  uint bufsize;
+  long long memory;  /* bytes taken up in memory */
+  long long filed;   /* bytes taken up by blocks in the spill file */
+  bool shared;       /* whether another thread is reading */
+  pthread_mutex_t mutex;
+} sb = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+static void
+sb_lock(void)
+{
+  if (sb.shared)
+    pthread_mutex_lock(&sb.mutex);
+}
+
+static void
+sb_unlock(void)
+{
+  if (sb.shared)
+    pthread_mutex_unlock(&sb.mutex);
+}
+
+/* The hot tier, in a ring. Its oldest lines may be queued for compression. */
+static struct {
+  termline *lines[SB_HOT_LINES + SB_QUEUE_LINES];
+  int start, count;
+  termline *spare;  /* evicted line kept for reuse */
+  long long memory;
+} hot;
+
+/* Number of the oldest line in the hot tier. */
+static long long
+hot_start(void)
+{ return sb.end - hot.count; }
+
+/* Line number n, which must be in the hot tier. */
+static termline *
+hot_line(long long n)
+{ return hot.lines[(hot.start + (n - hot_start())) % lengthof(hot.lines)]; }
+
+/* Add a hot line's memory to the totals, or with sign -1 take it away. */
+static void
+count_hot(termline *line, int sign)
+{
+  long long memory = sign * (long long)(sizeof *line +
+                                        line->size * sizeof(termchar));
+  hot.memory += memory;
+  sb.memory += memory;
+}
+
+/* Unpacked copies of recently used packed blocks. */
+static struct {
+  sbblock *block;
+  uchar *data;
+  uint size;
+  uint last_used;
+} unpacked[4];
+static uint unpacked_clock;
+
+static void
+forget_unpacked(sbblock *b)
+{
+  for (uint i = 0; i < lengthof(unpacked); i++) {
+    if (unpacked[i].block == b)
+      unpacked[i].block = null;
+  }
+}
+
+/*
+ * A file with blocks in it and its segments: the spill file, or the
+ * session file that blocks were restored from.
+ */
+typedef struct {
+  FILE *file;
+  int seg;          /* segment being filled */
+  long long pos;    /* where the next block goes */
+  int nsegs;
+  struct {
+    uchar *map;     /* mapping of the segment, or null */
+    uint blocks;    /* number of blocks stored in it */
+    uint last_used;
+  } *segs;
+  int mapped;
+  uint clock;
+} blockfile;
+
+static blockfile spill, session;
+
+static blockfile *
+block_file(sbblock *b)
+{ return b->restored ? &session : &spill; }
+
+static void
+unmap_oldest(blockfile *f)
+{
+  int lru = -1;
+  for (int j = 0; j < f->nsegs; j++) {
+    if (f->segs[j].map &&
+        (lru < 0 || f->segs[j].last_used < f->segs[lru].last_used))
+      lru = j;
+  }
+  munmap(f->segs[lru].map, SPILL_SEGMENT_SIZE);
+  f->segs[lru].map = null;
+  f->mapped--;
+}
+
+/*
+ * Map a segment of a block file, or return null if there's no address
+ * space for it even after dropping the other mappings.
+ */
+static uchar *
+map_segment(blockfile *f, int i)
+{
+  typeof(*f->segs) *seg = &f->segs[i];
+  if (!seg->map) {
+    // Keep the address space used for mappings in check.
+    if (f->mapped == SPILL_MAPPED_MAX)
+      unmap_oldest(f);
+    void *map;
+    while ((map = mmap(null, SPILL_SEGMENT_SIZE, PROT_READ, MAP_SHARED,
+                       fileno(f->file), (off_t)i * SPILL_SEGMENT_SIZE))
+           == MAP_FAILED) {
+      if (!f->mapped)
+        return null;
+      unmap_oldest(f);
+    }
+    seg->map = map;
+    f->mapped++;
+  }
+  seg->last_used = ++f->clock;
+  return seg->map;
+}
+
+static void
+close_block_file(blockfile *f)
+{
+  if (f->file) {
+    for (int i = 0; i < f->nsegs; i++) {
+      if (f->segs[i].map)
+        munmap(f->segs[i].map, SPILL_SEGMENT_SIZE);
+    }
+    free(f->segs);
+    fclose(f->file);
+    *f = (blockfile){.file = null};
+  }
+}
+
+/* Offset of the line ends after the data of a spilled block. */
+static uint
+spilled_ends_offset(sbblock *b)
+{ return ((b->packed ?: b->used) + 3) & ~3; }
+
+/*
+ * Move a sealed block to the spill file, returning whether that worked.
+ */
+static bool
+spill_block(sbblock *b)
+{
+  uint len = b->packed ?: b->used;
+  uint total = spilled_ends_offset(b) + b->lines * sizeof(uint);
+  if (total > SPILL_SEGMENT_SIZE)
+    return false;
+  if (!spill.file && !(spill.file = tmpfile()))
+    return false;
+  int fd = fileno(spill.file);
+
+  // Blocks don't straddle segments. Look for an unused one if needed.
+  int i = spill.seg;
+  long long pos = spill.pos;
+  if (i >= spill.nsegs ||
+      pos + total > (long long)(i + 1) * SPILL_SEGMENT_SIZE) {
+    i = 0;
+    while (i < spill.nsegs && spill.segs[i].blocks)
+      i++;
+    if (i == spill.nsegs) {
+      if (ftruncate(fd, (off_t)(i + 1) * SPILL_SEGMENT_SIZE) < 0)
+        return false;
+      spill.segs = renewn(spill.segs, ++spill.nsegs);
+      spill.segs[i].map = null;
+      spill.segs[i].blocks = 0;
+      spill.segs[i].last_used = 0;
+    }
+    pos = (long long)i * SPILL_SEGMENT_SIZE;
+  }
+
+  ssize_t ends_len = b->lines * sizeof(uint);
+  if (pwrite(fd, b->data, len, pos) != (ssize_t)len ||
+      pwrite(fd, b->ends, ends_len, pos + spilled_ends_offset(b)) != ends_len)
+    return false;
+
+  spill.seg = i;
+  spill.pos = pos + total;
+  spill.segs[i].blocks++;
+  free(b->data);
+  free(b->ends);
+  b->data = null;
+  b->ends = null;
+  b->spilled = pos;
+  return true;
+}
+
+/*
+ * Return the stored, possibly packed, data of a block, or null if its
+ * segment can't be mapped.
+ */
+static uchar *
+stored_data(sbblock *b)
+{
+  if (b->spilled < 0)
+    return b->data;
+  uchar *map = map_segment(block_file(b), b->spilled / SPILL_SEGMENT_SIZE);
+  return map ? map + b->spilled % SPILL_SEGMENT_SIZE : null;
+}
+
+/* Return the line ends of a block, or null like stored_data(). */
+static uint *
+block_ends(sbblock *b)
+{
+  if (b->spilled < 0)
+    return b->ends;
+  uchar *data = stored_data(b);
+  return data ? (uint *)(data + spilled_ends_offset(b)) : null;
+}
+
+/*
+ * Add a block's share of storage to the totals, or with sign -1 take it
+ * away, around anything that changes its size or where it's kept.
+ */
+static void
+count_block(sbblock *b, int sign)
+{
+  long long memory = sizeof *b + (1 << SB_SUMMARY_BITS) / 8;
+  if (b->spilled < 0)
+    memory += (b->packed ?: b->size) + b->ends_size * sizeof(uint);
+  else
+    sb.filed += sign * (spilled_ends_offset(b) + b->lines * sizeof(uint));
+  sb.memory += sign * memory;
+}
+
+static void
+free_block(sbblock *b)
+{
+  count_block(b, -1);
+  if (b->packed)
+    forget_unpacked(b);
+  if (b->spilled >= 0)
+    block_file(b)->segs[b->spilled / SPILL_SEGMENT_SIZE].blocks--;
+  free(b->data);
+  free(b->ends);
+  free(b->summary);
+  free(b);
+}
+
+/*
+ * Seal a full block: trim it so we don't waste any memory, and pack it
+ * if that saves a worthwhile amount.
+ */
+static void
+seal_block(sbblock *b)
+{
+  count_block(b, -1);
+  b->ends = renewn(b->ends, b->lines);
+  b->ends_size = b->lines;
+
+  uchar *packed = newn(uchar, lz_bound(b->used));
+  uint len = lz_compress(b->data, b->used, packed);
+  if (len < b->used - b->used / 8) {
+    free(b->data);
+    b->data = renewn(packed, len);
+    b->packed = len;
+  }
+  else {
+    free(packed);
+    b->data = renewn(b->data, b->used);
+  }
+  b->size = b->used;
+
+  if (cfg.scrollback_file)
+    spill_block(b);
+  count_block(b, +1);
+}
+
+static bool check_restored(sbblock *b, const uchar *stored,
+                           const uchar *data);
+
+/* Check a restored block when it's first read. */
+static bool
+restored_intact(sbblock *b, const uchar *stored, const uchar *data)
+{
+  if (b->restored && !b->checked)
+    b->checked = check_restored(b, stored, data);
+  return !b->restored || b->checked;
+}
+
+/*
+ * Return the unpacked data of a block, or null if it can't be read back,
+ * as its file has been damaged or can't be mapped.
+ */
+static uchar *
+block_data(sbblock *b)
+{
+  if (!b->packed) {
+    uchar *data = stored_data(b);
+    return data && restored_intact(b, data, data) ? data : null;
+  }
+
+  uint lru = 0;
+  for (uint i = 0; i < lengthof(unpacked); i++) {
+    if (unpacked[i].block == b) {
+      unpacked[i].last_used = ++unpacked_clock;
+      return unpacked[i].data;
+    }
+    if (unpacked[i].last_used < unpacked[lru].last_used)
+      lru = i;
+  }
+
+  uchar *stored = stored_data(b);
+  if (!stored)
+    return null;
+  typeof(*unpacked) *u = &unpacked[lru];
+  u->block = null;
+  if (u->size < b->used) {
+    free(u->data);
+    u->data = newn(uchar, b->used);
+    u->size = b->used;
+  }
+  if (lz_decompress(stored, b->packed, u->data, b->used)
+      != (int)b->used || !restored_intact(b, stored, u->data))
+    return null;
+  u->block = b;
+  u->last_used = ++unpacked_clock;
+  return u->data;
+}
+
+/*
+ * Turn a packed or spilled block back into a normal one, so that it can be
+ * changed.
+ */
+static void
+unseal_block(sbblock *b)
+{
+  count_block(b, -1);
+  uchar *data = block_data(b);
+  uint *ends = data ? block_ends(b) : null;
+  if (!ends) {
+    // Make do with blank lines, dropping any references to shared lines.
+    termline *line = newline(term.cols, false);
+    uint len = compressline(line, &sb.buf, &sb.bufsize);
+    freeline(line);
+    data = newn(uchar, b->lines * len);
+    if (b->spilled >= 0)
+      b->ends = newn(uint, b->lines);
+    for (uint j = 0; j < b->lines; j++) {
+      memcpy(data + j * len, sb.buf, len);
+      b->ends[j] = (j + 1) * len;
+    }
+    b->used = b->lines * len;
+    b->refs = 0;
+  }
+  else {
+    data = memcpy(newn(uchar, b->used), data, b->used);
+    if (b->spilled >= 0)
+      b->ends = memcpy(newn(uint, b->lines), ends, b->lines * sizeof(uint));
+  }
+  b->size = b->used;
+  if (b->spilled >= 0) {
+    block_file(b)->segs[b->spilled / SPILL_SEGMENT_SIZE].blocks--;
+    b->spilled = -1;
+    b->restored = false;
+  }
+  forget_unpacked(b);
+  free(b->data);
+  b->data = data;
+  b->packed = 0;
+  count_block(b, +1);
+}
+
+/*
+ * The cache of decompressed lines. Entries are numbered from 1, so that 0
+ * can terminate the hash chains and the LRU list.
+ */
+static struct {
+  struct {
+    long long n;          /* number of the cached line */
+    termline *line;
+    ushort older, newer;  /* neighbours in the LRU list */
+    ushort next;          /* next entry in hash chain or free list */
+  } entries[SB_CACHE_SIZE + 1];
+  ushort buckets[SB_CACHE_SIZE * 2];
+  ushort newest, oldest;
+  ushort free;            /* first entry in the free list */
+  ushort top;             /* number of entries ever used */
+} cache;
+
+#define centry(i) cache.entries[i]
+
+static ushort *
+cache_bucket(long long n)
+{ return &cache.buckets[n & (lengthof(cache.buckets) - 1)]; }
+
+static ushort
+cache_find(long long n)
+{
+  ushort i = *cache_bucket(n);
+  while (i && centry(i).n != n)
+    i = centry(i).next;
+  return i;
+}
+
+static void
+cache_unlink(ushort i)
+{
+  ushort *p = cache_bucket(centry(i).n);
+  while (*p != i)
+    p = &centry(*p).next;
+  *p = centry(i).next;
+
+  ushort older = centry(i).older, newer = centry(i).newer;
+  if (older)
+    centry(older).newer = newer;
+  else
+    cache.oldest = newer;
+  if (newer)
+    centry(newer).older = older;
+  else
+    cache.newest = older;
+}
+
+static void
+cache_link(ushort i)
+{
+  ushort *p = cache_bucket(centry(i).n);
+  centry(i).next = *p;
+  *p = i;
+
+  centry(i).older = cache.newest;
+  centry(i).newer = 0;
+  if (cache.newest)
+    centry(cache.newest).newer = i;
+  else
+    cache.oldest = i;
+  cache.newest = i;
+}
+
+static void
+cache_drop(ushort i)
+{
+  cache_unlink(i);
+  freeline(centry(i).line);
+  centry(i).next = cache.free;
+  cache.free = i;
+}
+
+static void
+cache_add(long long n, termline *line)
+{
+  ushort i;
+  if (cache.free) {
+    i = cache.free;
+    cache.free = centry(i).next;
+  }
+  else if (cache.top < SB_CACHE_SIZE)
+    i = ++cache.top;
+  else {
+    i = cache.oldest;
+    cache_unlink(i);
+    freeline(centry(i).line);
+  }
+  line->temporary = false;
+  centry(i).n = n;
+  centry(i).line = line;
+  cache_link(i);
+}
+
+/* Drop a line from the cache if it's in there. */
+static void
+cache_forget(long long n)
+{
+  ushort i = cache_find(n);
+  if (i)
+    cache_drop(i);
+}
+
+/*
+ * Empty the cache of decompressed lines, for example because they no
+ * longer fit the screen.
+ */
+void
+scrollback_uncache(void)
+{
+  while (cache.newest)
+    cache_drop(cache.newest);
+}
+
+/* The bit for a trigram in a block summary. */
+static inline uint
+summary_bit(uint hash)
+{ return hash >> (32 - SB_SUMMARY_BITS); }
+
+/*
+ * Work out the summary bits for the trigrams in a line, with room for one
+ * per column in bits, and return their number.
+ */
+static uint
+trigram_bits(termline *line, ushort *bits)
+{
+  // Trailing blanks don't make for useful trigrams.
+  termchar *chars = line->chars;
+  int cols = line->cols;
+  while (cols > 0 && chars[cols - 1].chr == ' ')
+    cols--;
+
+  uint key = 0, nbits = 0;
+  int n = 0;
+  for (int x = 0; x < cols; x++) {
+    wchar c = chars[x].chr;
+    if (c == UCSWIDE)
+      continue;
+    key = key << 5 ^ fold_char(c);
+    if (++n >= 3)
+      bits[nbits++] = summary_bit(trigram_hash(key));
+  }
+  return nbits;
+}
+
+static void
+summarise_line(sbblock *b, const ushort *bits, uint nbits)
+{
+  for (uint i = 0; i < nbits; i++)
+    b->summary[bits[i] / 32] |= 1u << bits[i] % 32;
+}
+
+static bool
+summary_has(sbblock *b, const uint *trigrams, int ntrigrams)
+{
+  for (int t = 0; t < ntrigrams; t++) {
+    uint bit = summary_bit(trigrams[t]);
+    if (!(b->summary[bit / 32] & 1u << bit % 32))
+      return false;
+  }
+  return true;
+}
+
+/* Number of the oldest line that is still stored. */
+static long long
+sb_start(void)
+{ return sb.end - term.sblines; }
+
+/*
+ * Shared lines.
+ *
+ * A line that comes up again and again is stored just once, outside the
+ * blocks, with a count of the references to it. In its place, blocks hold
+ * a reference: the bytes 0x80 0x00, which compressline() never starts a
+ * line with, followed by the number of the shared line, encoded like the
+ * column count of a line. Shared lines are looked up by a hash of their
+ * compressed form, and numbered from 1, so that 0 can terminate the hash
+ * chains and the free list.
+ *
+ * So that lines that only appear once aren't stored twice, a line is
+ * only shared once it is repeated. To spot repeats, copies of recent
+ * lines are kept in a ring buffer, where they can be compared without
+ * unpacking blocks.
+ */
+static struct {
+  struct {
+    uchar *data;
+    uint len, hash;
+    uint refs;        /* number of references, or 0 if unused */
+    uint next;        /* next entry in hash chain or free list */
+  } *entries;
+  uint top, size;     /* highest entry used, and entries allocated */
+  uint count;         /* number of entries in use */
+  uint free;          /* first entry in the free list */
+  uint *buckets;
+  uint nbuckets;
+} shared;
+
+#define sentry(i) shared.entries[i]
+
+/* Recent lines by hash, for spotting repeats. */
+static struct {
+  struct {
+    uint hash, len;
+    long long pos;    /* where in the ring it went */
+  } lines[SB_RECENT_SIZE];
+  uchar *ring;
+  long long end;      /* position after the last line */
+} recent;
+
+static uint
+hash_bytes(const uchar *p, uint len)
+{
+  uint hash = len;
+  for (; len >= 4; p += 4, len -= 4) {
+    uint word;
+    memcpy(&word, p, 4);
+    hash = (hash ^ word) * 0x9E3779B1;
+    hash ^= hash >> 15;
+  }
+  while (len--)
+    hash = (hash ^ *p++) * 0x9E3779B1;
+  return hash ^ hash >> 16;
+}
+
+static inline bool
+is_ref(const uchar *p)
+{ return p[0] == 0x80 && p[1] == 0; }
+
+static uint
+ref_id(const uchar *p)
+{
+  uint id = 0;
+  int shift = 0;
+  uchar byte;
+  p += 2;
+  do {
+    byte = *p++;
+    id |= (byte & 0x7F) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return id;
+}
+
+/* Write a reference to shared line id, returning its length. */
+static uint
+make_ref(uchar *p, uint id)
+{
+  uint len = 2;
+  p[0] = 0x80;
+  p[1] = 0;
+  while (id >= 128) {
+    p[len++] = (id & 0x7F) | 0x80;
+    id >>= 7;
+  }
+  p[len++] = id;
+  return len;
+}
+
+/* The compressed line at p, following a reference if it is one. */
+static inline uchar *
+line_data(uchar *p)
+{ return is_ref(p) ? sentry(ref_id(p)).data : p; }
+
+/* Hash of the stored data and line ends of a block, for session files. */
+static uint
+block_check(sbblock *b, const uchar *stored, const uint *ends)
+{
+  return hash_bytes(stored, b->packed ?: b->used) * 31 +
+         hash_bytes((const uchar *)ends, b->lines * sizeof(uint));
+}
+
+/*
+ * Check that a block restored from a session file, given its stored and
+ * unpacked data, is as it was saved, and that its lines only refer to
+ * shared lines that exist, as the file may have been damaged since.
+ */
+static bool
+check_restored(sbblock *b, const uchar *stored, const uchar *data)
+{
+  const uint *ends = (const uint *)(stored + spilled_ends_offset(b));
+  if (block_check(b, stored, ends) != b->check)
+    return false;
+  uint start = 0, refs = 0;
+  for (uint j = 0; j < b->lines; j++) {
+    if (ends[j] <= start || ends[j] > b->used)
+      return false;
+    const uchar *p = data + start;
+    if (ends[j] - start >= 3 && is_ref(p)) {
+      uint id = ref_id(p);
+      if (!id || id > shared.top || !sentry(id).refs)
+        return false;
+      refs++;
+    }
+    start = ends[j];
+  }
+  return start == b->used && refs == b->refs;
+}
+
+static void
+link_shared(uint id)
+{
+  if (shared.count > shared.nbuckets) {
+    free(shared.buckets);
+    shared.nbuckets = shared.nbuckets * 2 ?: 1024;
+    shared.buckets = newn(uint, shared.nbuckets);
+    for (uint i = 1; i <= shared.top; i++) {
+      if (sentry(i).refs && i != id) {
+        uint *p = &shared.buckets[sentry(i).hash & (shared.nbuckets - 1)];
+        sentry(i).next = *p;
+        *p = i;
+      }
+    }
+  }
+  uint *p = &shared.buckets[sentry(id).hash & (shared.nbuckets - 1)];
+  sentry(id).next = *p;
+  *p = id;
+}
+
+/* Add a shared line with one reference to it, returning its number. */
+static uint
+add_shared(const uchar *data, uint len, uint hash)
+{
+  uint id;
+  if (shared.free) {
+    id = shared.free;
+    shared.free = sentry(id).next;
+  }
+  else {
+    if (shared.top + 1 >= shared.size) {
+      shared.size = shared.size * 2 + 256;
+      shared.entries = renewn(shared.entries, shared.size);
+    }
+    id = ++shared.top;
+  }
+  sentry(id).data = memcpy(newn(uchar, len), data, len);
+  sentry(id).len = len;
+  sentry(id).hash = hash;
+  sentry(id).refs = 1;
+  shared.count++;
+  link_shared(id);
+  sb.memory += sizeof *shared.entries + len;
+  return id;
+}
+
+/* Drop a reference to a shared line, and the line with the last one. */
+static void
+unref_shared(uint id)
+{
+  if (--sentry(id).refs)
+    return;
+  uint *p = &shared.buckets[sentry(id).hash & (shared.nbuckets - 1)];
+  while (*p != id)
+    p = &sentry(*p).next;
+  *p = sentry(id).next;
+  sb.memory -= sizeof *shared.entries + sentry(id).len;
+  free(sentry(id).data);
+  sentry(id).next = shared.free;
+  shared.free = id;
+  shared.count--;
+}
+
+static void
+clear_shared(void)
+{
+  for (uint i = 1; i <= shared.top; i++) {
+    if (sentry(i).refs) {
+      sb.memory -= sizeof *shared.entries + sentry(i).len;
+      free(sentry(i).data);
+    }
+  }
+  free(shared.entries);
+  free(shared.buckets);
+  shared = (typeof(shared)){.entries = null};
+  free(recent.ring);
+  memset(&recent, 0, sizeof recent);
+}
+
+/*
+ * Look for a compressed line among the shared lines and the recent lines,
+ * and if it's there, return the number of the shared line, with a new
+ * reference to it. Otherwise return 0.
+ */
+static uint
+share_line(const uchar *data, uint len, uint hash)
+{
+  if (shared.nbuckets) {
+    uint id = shared.buckets[hash & (shared.nbuckets - 1)];
+    for (; id; id = sentry(id).next) {
+      if (sentry(id).hash == hash && sentry(id).len == len &&
+          !memcmp(sentry(id).data, data, len)) {
+        sentry(id).refs++;
+        return id;
+      }
+    }
+  }
+
+  if (len > SB_RECENT_BYTES / 16)
+    return 0;
+  if (!recent.ring)
+    recent.ring = newn(uchar, SB_RECENT_BYTES);
+  typeof(*recent.lines) *r = &recent.lines[hash % SB_RECENT_SIZE];
+  if (r->hash == hash && r->len == len &&
+      r->pos >= recent.end - SB_RECENT_BYTES &&
+      !memcmp(recent.ring + r->pos % SB_RECENT_BYTES, data, len)) {
+    r->hash = r->len = 0;
+    return add_shared(data, len, hash);
+  }
+
+  // Remember the line, without wrapping around the end of the ring.
+  long long pos = recent.end;
+  if (pos % SB_RECENT_BYTES + len > SB_RECENT_BYTES)
+    pos += SB_RECENT_BYTES - pos % SB_RECENT_BYTES;
+  memcpy(recent.ring + pos % SB_RECENT_BYTES, data, len);
+  recent.end = pos + len;
+  *r = (typeof(*r)){.hash = hash, .len = len, .pos = pos};
+  return 0;
+}
+
+/* Drop the references to shared lines held by a block. */
+static void
+release_refs(sbblock *b)
+{
+  uchar *data = b->refs ? block_data(b) : null;
+  uint *ends = data ? block_ends(b) : null;
+  if (!ends)
+    return;
+  for (uint j = 0; j < b->lines; j++) {
+    uchar *p = data + (j ? ends[j - 1] : 0);
+    if (is_ref(p))
+      unref_shared(ref_id(p));
+  }
+  b->refs = 0;
+}
+
+/*
+ * The queue of lines to be compressed by the compression thread, which
+ * also works out their summary bits and hashes. The terminal thread adds
+ * jobs at the tail and takes them from the head once they are done, so
+ * the lines in the queue are always the oldest ones in the hot tier. Each
+ * thread only writes one of the counters, so no lock is needed for that,
+ * just for sleeping while there is nothing to do.
+ */
+typedef struct {
+  termline *line;
+  uchar *data;      /* the compressed line */
+  uint len, size;
+  uint hash;        /* see hash_bytes(), or 0 if too short to share */
+  ushort *bits;     /* summary bits of the line's trigrams */
+  uint nbits, bits_size;
+} sbjob;
+
+static struct {
+  sbjob jobs[SB_QUEUE_LINES];
+  uint head, done, tail;  /* counts of jobs taken, done and added */
+  bool started;     /* whether starting the thread has been tried */
+  bool threaded;    /* whether that worked */
+  bool idle;        /* whether the thread is waiting for jobs */
+  pthread_mutex_t mutex;
+  pthread_cond_t wake, finished;
+} queue = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+           .wake = PTHREAD_COND_INITIALIZER,
+           .finished = PTHREAD_COND_INITIALIZER};
+
+/* Number of hot lines in the queue. */
+static int
+queued(void)
+{ return queue.tail - queue.head; }
+
+static void
+run_job(sbjob *j)
+{
+  termline *line = j->line;
+  j->len = compressline(line, &j->data, &j->size);
+  j->hash = j->len >= SB_SHARE_MIN ? hash_bytes(j->data, j->len) : 0;
+  if (j->bits_size < (uint)line->cols) {
+    free(j->bits);
+    j->bits_size = line->cols;
+    j->bits = newn(ushort, j->bits_size);
+  }
+  j->nbits = trigram_bits(line, j->bits);
+}
+
+static void *
+compress_thread(void *unused)
+{
+  (void)unused;
+  pthread_mutex_lock(&queue.mutex);
+  for (;;) {
+    // Go idle before checking for jobs, so that queue_line() can tell
+    // whether it needs to wake us up.
+    __atomic_store_n(&queue.idle, true, __ATOMIC_SEQ_CST);
+    uint done = queue.done;
+    uint tail = __atomic_load_n(&queue.tail, __ATOMIC_SEQ_CST);
+    if (done == tail) {
+      pthread_cond_broadcast(&queue.finished);
+      pthread_cond_wait(&queue.wake, &queue.mutex);
+      continue;
+    }
+    __atomic_store_n(&queue.idle, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&queue.mutex);
+    while (done != tail) {
+      run_job(&queue.jobs[done % SB_QUEUE_LINES]);
+      __atomic_store_n(&queue.done, ++done, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&queue.mutex);
+  }
+  return 0;
+}
+
+/*
+ * Hand the oldest hot line that isn't queued yet over for compression.
+ * The compression thread is only woken up for a batch of lines. Without a
+ * processor to spare or if the thread can't be started, lines are
+ * compressed right away instead.
+ */
+static void
+queue_line(void)
+{
+  assert(queued() < SB_QUEUE_LINES);
+  if (!queue.started) {
+    queue.started = true;
+    pthread_t thread;
+    queue.threaded = sysconf(_SC_NPROCESSORS_ONLN) > 1 &&
+                     !pthread_create(&thread, null, compress_thread, null);
+    if (queue.threaded)
+      pthread_detach(thread);
+  }
+
+  // Without the thread, lines are stored right after compressing them, so
+  // go back to the first job whenever the queue is empty, as its buffers
+  // are still in the cache.
+  if (!queue.threaded && queue.head == queue.tail)
+    queue.head = queue.done = queue.tail = 0;
+
+  sbjob *j = &queue.jobs[queue.tail % SB_QUEUE_LINES];
+  j->line = hot.lines[(hot.start + queued()) % lengthof(hot.lines)];
+  if (!queue.threaded) {
+    run_job(j);
+    queue.done = ++queue.tail;
+    return;
+  }
+
+  __atomic_store_n(&queue.tail, queue.tail + 1, __ATOMIC_SEQ_CST);
+  if (queue.tail - __atomic_load_n(&queue.done, __ATOMIC_RELAXED) >= SB_BATCH &&
+      __atomic_load_n(&queue.idle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&queue.mutex);
+    pthread_cond_signal(&queue.wake);
+    pthread_mutex_unlock(&queue.mutex);
+  }
+}
+
+/* Whether the job with the given count is done. */
+static bool
+job_done(uint i)
+{ return (int)(__atomic_load_n(&queue.done, __ATOMIC_ACQUIRE) - i) > 0; }
+
+/* Wait for the job with the given count to be done. */
+static void
+wait_for_job(uint i)
+{
+  if (job_done(i))
+    return;
+  pthread_mutex_lock(&queue.mutex);
+  pthread_cond_signal(&queue.wake);
+  while (!job_done(i))
+    pthread_cond_wait(&queue.finished, &queue.mutex);
+  pthread_mutex_unlock(&queue.mutex);
+}
+
+/*
+ * Take the oldest job off the queue, waiting for it if necessary. Its
+ * results remain valid until the next line is queued.
+ */
+static sbjob *
+finish_job(void)
+{
+  wait_for_job(queue.head);
+  return &queue.jobs[queue.head++ % SB_QUEUE_LINES];
+}
+
+/*
+ * Take the oldest line out of the hot tier. The caller deals with its job
+ * if it is queued.
+ */
+static termline *
+take_oldest_hot(void)
+{
+  termline *line = hot.lines[hot.start];
+  hot.start = (hot.start + 1) % lengthof(hot.lines);
+  hot.count--;
+  count_hot(line, -1);
+  return line;
+}
+
+/*
+ * Throw away the oldest line, and with it the oldest block if it doesn't
+ * hold any more lines that are still needed.
+ */
+static void
+drop_oldest(void)
+{
+  assert(term.sblines > 0);
+  cache_forget(sb_start());
+  term.sblines--;
+  term.tempsblines = min(term.tempsblines, term.sblines);
+  if (!sb.nblocks) {
+    // The oldest line is in the hot tier. Keep it for reuse.
+    if (hot.spare)
+      freeline(hot.spare);
+    if (queued())
+      finish_job();
+    hot.spare = take_oldest_hot();
+    return;
+  }
+  sbblock *b = sb.blocks[0];
+  if (b->first + b->lines <= sb_start()) {
+    release_refs(b);
+    free_block(b);
+    sb.nblocks--;
+    memmove(sb.blocks, sb.blocks + 1, sb.nblocks * sizeof *sb.blocks);
+  }
+}
+
+/*
+ * Evict the oldest blocks while over the size limit, but always keep the
+ * newest one.
+ */
+static void
+keep_to_size(void)
+{
+  long long limit = (long long)cfg.scrollback_size << 10;
+  while (limit && sb.memory + sb.filed > limit && sb.nblocks > 1) {
+    int nblocks = sb.nblocks;
+    do
+      drop_oldest();
+    while (sb.nblocks == nblocks);
+  }
+}
+
+/* Add line number n to the blocks, as compressed by its job. */
+static void
+store_line(sbjob *j, long long n)
+{
+  // Store a reference instead if the line has been seen before.
+  uchar *data = j->data, ref[8];
+  uint len = j->len;
+  uint id = j->hash ? share_line(data, len, j->hash) : 0;
+  if (id) {
+    data = ref;
+    len = make_ref(ref, id);
+  }
+
+  // Start a new block if the line doesn't fit into the current one.
+  sbblock *b = sb.nblocks ? sb.blocks[sb.nblocks - 1] : null;
+  if (!b || b->size - b->used < len) {
+    if (b && b->spilled < 0)  // restored blocks are sealed already
+      seal_block(b);
+    if (sb.nblocks == sb.size) {
+      sb.size = sb.size * 2 + 16;
+      sb.blocks = renewn(sb.blocks, sb.size);
+    }
+    b = sb.blocks[sb.nblocks++] = new(sbblock);
+    b->first = n;
+    b->lines = b->used = b->packed = b->ends_size = 0;
+    b->size = max(SB_BLOCK_SIZE, len);
+    b->data = newn(uchar, b->size);
+    b->ends = 0;
+    b->spilled = -1;
+    b->restored = false;
+    b->summary = newn(uint, (1 << SB_SUMMARY_BITS) / 32);
+    b->refs = 0;
+    count_block(b, +1);
+  }
+
+  if (b->lines == b->ends_size) {
+    sb.memory -= b->ends_size * sizeof(uint);
+    b->ends_size = b->ends_size * 2 + 256;
+    b->ends = renewn(b->ends, b->ends_size);
+    sb.memory += b->ends_size * sizeof(uint);
+  }
+  memcpy(b->data + b->used, data, len);
+  b->used += len;
+  b->ends[b->lines++] = b->used;
+  summarise_line(b, j->bits, j->nbits);
+  if (id)
+    b->refs++;
+}
+
+/*
+ * Move the oldest line of the hot tier, which must be queued, into the
+ * blocks, and return it.
+ */
+static termline *
+age_out(void)
+{
+  sbjob *j = finish_job();
+  termline *line = take_oldest_hot();
+  store_line(j, hot_start() - 1);
+  return line;
+}
+
+/* Move all of the hot tier into the blocks. */
+static void
+flush_hot(void)
+{
+  while (hot.count) {
+    while (queued() < min(hot.count, SB_QUEUE_LINES))
+      queue_line();
+    freeline(age_out());
+  }
+}
+
+/*
+ * Add a line to the scrollback, evicting the oldest line if the
+ * scrollback is full. The scrollback takes over the line, and hands back
+ * one at least as wide for reuse, which needs clearing.
+ */
+termline *
+scrollback_push(termline *line)
+{
+  if (!term.sblines && !cfg.scrollback_lines)
+    return line;
+
+  if (line->blank)
+    fillline(line);
+
+  sb_lock();
+  while (term.sblines > 0 && term.sblines >= cfg.scrollback_lines)
+    drop_oldest();
+  if (!cfg.scrollback_lines) {
+    // The scrollback has just been switched off.
+    sb_unlock();
+    return line;
+  }
+
+  // Queue the lines that age out, making room in the queue if need be.
+  // With a size limit, the hot tier only gets a small share of it.
+  long long limit = (long long)cfg.scrollback_size << 10;
+  termline *spare = hot.spare;
+  hot.spare = null;
+  while (hot.count - queued() >= SB_HOT_LINES ||
+         (limit && hot.count > queued() && hot.memory > limit / 16)) {
+    if (queued() == SB_QUEUE_LINES) {
+      if (spare)
+        freeline(spare);
+      spare = age_out();
+    }
+    queue_line();
+  }
+
+  // Put a compressed line into the blocks to get a line for reuse, unless
+  // that would mean waiting. A couple of batches are kept in the queue
+  // though, so that the compression thread can keep ahead.
+  int backlog = queue.threaded ? 2 * SB_BATCH : 0;
+  while ((queued() > backlog && !spare && job_done(queue.head)) ||
+         (queued() && limit && hot.memory > limit / 8)) {
+    if (spare)
+      freeline(spare);
+    spare = age_out();
+  }
+  hot.lines[(hot.start + hot.count++) % lengthof(hot.lines)] = line;
+  count_hot(line, +1);
+
+  sb.end++;
+  term.sblines++;
+  if (term.tempsblines < term.sblines)
+    term.tempsblines++;
+
+  keep_to_size();
+  sb_unlock();
+
+  if (!spare)
+    return newline(line->cols, false);
+  resizeline(spare, line->cols);
+  return spare;
+}
+
+/*
+ * Remove the newest line from the scrollback and return it as a normal
+ * screen line.
+ */
+termline *
+scrollback_pop(void)
+{
+  assert(term.sblines > 0);
+  cache_forget(sb.end - 1);
+  sb_lock();
+  termline *line;
+  sbblock *b = null;
+  if (hot.count && hot.count == queued())
+    flush_hot();  // rather than taking lines back from the queue
+  if (hot.count) {
+    line = hot_line(sb.end - 1);
+    hot.count--;
+    count_hot(line, -1);
+  }
+  else {
+    b = sb.blocks[sb.nblocks - 1];
+    if (b->packed || b->spilled >= 0)
+      unseal_block(b);
+    uint start = b->lines > 1 ? b->ends[b->lines - 2] : 0;
+    uchar *p = b->data + start;
+    line = decompressline(line_data(p), null);
+    line->temporary = false;
+    if (is_ref(p)) {
+      unref_shared(ref_id(p));
+      b->refs--;
+    }
+    b->used = start;
+    b->lines--;
+  }
+  sb.end--;
+  term.sblines--;
+  if (term.tempsblines)
+    term.tempsblines--;
+
+  if (!term.sblines) {
+    // Don't hang on to blocks with evicted lines only.
+    while (sb.nblocks)
+      free_block(sb.blocks[--sb.nblocks]);
+    clear_shared();
+  }
+  else if (b && !b->lines) {
+    free_block(b);
+    sb.nblocks--;
+  }
+  sb_unlock();
+  return line;
+}
+
+/* The block holding line number n, which must still be stored. */
+static sbblock *
+find_block(long long n)
+{
+  // Find the last block that starts at or before the line.
+  int lo = 0, hi = sb.nblocks - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (sb.blocks[mid]->first <= n)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return sb.blocks[lo];
+}
+
+/* Decompress line number n, which must still be stored. */
+static termline *
+decode_line(long long n)
+{
+  sbblock *b = find_block(n);
+  uint j = n - b->first;
+  assert(j < b->lines);
+  uchar *data = block_data(b);
+  uint *ends = data ? block_ends(b) : null;
+  if (!ends) {
+    termline *line = newline(term.cols, false);
+    line->temporary = true;
+    return line;
+  }
+  return decompressline(line_data(data + (j ? ends[j - 1] : 0)), null);
+}
+
+/*
+ * Get a scrollback line, with y running from -term.sblines for the oldest
+ * line to -1 for the newest. The line belongs to the cache of decompressed
+ * lines.
+ */
+termline *
+scrollback_fetch(int y)
+{
+  assert(y < 0 && y >= -term.sblines);
+  long long n = sb.end + y;
+
+  if (n >= hot_start()) {
+    // Widen it here rather than in fetch_line(), to keep count of memory.
+    termline *line = hot_line(n);
+    if (line->cols < term.cols) {
+      // Mustn't change it while it's being compressed.
+      int i = n - hot_start();
+      if (i < queued())
+        wait_for_job(queue.head + i);
+      sb_lock();
+      count_hot(line, -1);
+      resizeline(line, term.cols);
+      count_hot(line, +1);
+      sb_unlock();
+    }
+    return line;
+  }
+
+  ushort i = cache_find(n);
+  if (i) {
+    cache_unlink(i);
+    cache_link(i);
+    return centry(i).line;
+  }
+
+  termline *line = decode_line(n);
+  cache_add(n, line);
+  return line;
+}
+
+/*
+ * Get a scrollback line like scrollback_fetch(), but without adding it to
+ * the cache, for going through lots of lines once. Trailing blanks may be
+ * missing. The line is to be released with release_line().
+ */
+termline *
+scrollback_peek(int y)
+{
+  assert(y < 0 && y >= -term.sblines);
+  long long n = sb.end + y;
+  if (n >= hot_start())
+    return hot_line(n);
+  ushort i = cache_find(n);
+  return i ? centry(i).line : decode_line(n);
+}
+
+/*
+ * Check whether scrollback line number n might contain all of the given
+ * trigrams. Lines of the same block give the same answer.
+ */
+bool
+scrollback_may_contain(long long n, const uint *trigrams, int ntrigrams)
+{
+  return n >= hot_start() ||
+         summary_has(find_block(n), trigrams, ntrigrams);
+}
+
+/*
+ * Get at the unpacked data and the line ends of a block from a thread
+ * other than the main one, using the given buffers for reading and
+ * unpacking it. With copy set, the results never point into the block
+ * itself.
+ */
+static bool
+load_block(sbbuffer *buf, sbblock *b, bool copy, uchar **data, uint **ends)
+{
+  uchar *d = b->data;
+  uint *e = b->ends;
+
+  // Spilled blocks are read rather than mapped, as mapping isn't thread-safe.
+  if (b->spilled >= 0) {
+    uint total = spilled_ends_offset(b) + b->lines * sizeof(uint);
+    if (buf->stored_size < total) {
+      free(buf->stored);
+      buf->stored = newn(uchar, total);
+      buf->stored_size = total;
+    }
+    if (pread(fileno(block_file(b)->file), buf->stored, total, b->spilled)
+        != (ssize_t)total)
+      return false;
+    d = buf->stored;
+    e = (uint *)(buf->stored + spilled_ends_offset(b));
+  }
+  else if (copy) {
+    uint total = b->lines * sizeof(uint);
+    if (buf->stored_size < total) {
+      free(buf->stored);
+      buf->stored = newn(uchar, total);
+      buf->stored_size = total;
+    }
+    e = memcpy(buf->stored, e, total);
+  }
+
+  uchar *stored = d;
+  if (b->packed || (copy && b->spilled < 0)) {
+    if (buf->unpacked_size < b->used) {
+      free(buf->unpacked);
+      buf->unpacked = newn(uchar, b->used);
+      buf->unpacked_size = b->used;
+    }
+    if (!b->packed)
+      memcpy(buf->unpacked, d, b->used);
+    else if (lz_decompress(d, b->packed, buf->unpacked, b->used)
+             != (int)b->used)
+      return false;
+    d = buf->unpacked;
+  }
+  if (b->restored && !check_restored(b, stored, d))
+    return false;
+
+  *data = d;
+  *ends = e;
+  return true;
+}
+
+/*
+ * A parallel scan of the scrollback. Threads take the blocks in turn.
+ */
+typedef struct {
+  const uint *trigrams;
+  int ntrigrams;
+  void (*fn)(void *arg, long long n, termline *line);
+  long long start;
+  int next;          /* next block to be taken */
+} scan_job;
+
+typedef struct {
+  scan_job *job;
+  void *arg;
+  sbbuffer buf;
+} scanner;
+
+static void
+scan_block(scanner *s, sbblock *b)
+{
+  uchar *data;
+  uint *ends;
+  if (!load_block(&s->buf, b, false, &data, &ends))
+    return;
+
+  for (uint j = 0; j < b->lines; j++) {
+    long long n = b->first + j;
+    if (n >= s->job->start) {
+      termline *line =
+        decompressline(line_data(data + (j ? ends[j - 1] : 0)), null);
+      s->job->fn(s->arg, n, line);
+      freeline(line);
+    }
+  }
+}
+
+static void *
+scan_thread(void *arg)
+{
+  scanner *s = arg;
+  scan_job *job = s->job;
+  int i;
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < sb.nblocks) {
+    sbblock *b = sb.blocks[i];
+    if (summary_has(b, job->trigrams, job->ntrigrams))
+      scan_block(s, b);
+  }
+  scrollback_free_buffer(&s->buf);
+  return 0;
+}
+
+/*
+ * Go through the lines of the blocks whose summaries have all of the
+ * given trigrams, on up to nthreads threads at once. Each thread calls fn
+ * for each of its lines, passing its own element of args. This returns
+ * when all is done, and the scrollback must not change until then.
+ */
+void
+scrollback_scan(const uint *trigrams, int ntrigrams,
+                void (*fn)(void *arg, long long n, termline *line),
+                void **args, int nthreads)
+{
+  scan_job job = {
+    .trigrams = trigrams, .ntrigrams = ntrigrams, .fn = fn,
+    .start = sb_start(), .next = 0
+  };
+  scanner scanners[nthreads];
+  pthread_t threads[nthreads];
+  int started = 1;
+  for (int i = 0; i < nthreads; i++) {
+    scanners[i] = (scanner){.job = &job, .arg = args[i]};
+    if (i && !pthread_create(&threads[started], null, scan_thread,
+                             &scanners[i]))
+      started++;
+  }
+  // This thread does its share too, and the hot tier.
+  scan_thread(&scanners[0]);
+  for (long long n = max(job.start, hot_start()); n < sb.end; n++)
+    fn(args[0], n, hot_line(n));
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], null);
+}
+
+
+/*
+ * A run of lines in a block that one of the threads is to decode. The
+ * data of the block is only given if it's at hand already.
+ */
+typedef struct {
+  sbblock *block;
+  uchar *data;
+  uint *ends;
+  long long start, end;
+} decode_slice;
+
+typedef struct {
+  decode_slice *slices;
+  int nslices, next;
+  long long first;   /* number of the first line of the range */
+  termline **lines;  /* decoded lines, by number from first */
+} decode_job;
+
+static void
+decode_lines(decode_job *job)
+{
+  sbbuffer buf = {.stored = null};
+  sbblock *loaded = null;
+  uchar *data = 0;
+  uint *ends = 0;
+  int i;
+  while ((i = __sync_fetch_and_add(&job->next, 1)) < job->nslices) {
+    decode_slice *s = &job->slices[i];
+    sbblock *b = s->block;
+    if (s->data) {
+      data = s->data;
+      ends = s->ends;
+      loaded = null;
+    }
+    else if (b != loaded) {
+      loaded = load_block(&buf, b, false, &data, &ends) ? b : null;
+      if (!loaded)
+        continue;  // left to scrollback_fetch()
+    }
+    for (long long n = s->start; n < s->end; n++) {
+      uint j = n - b->first;
+      job->lines[n - job->first] =
+        decompressline(line_data(data + (j ? ends[j - 1] : 0)), null);
+    }
+  }
+  scrollback_free_buffer(&buf);
+}
+
+/*
+ * Threads that help with decoding, started when first needed. Each job
+ * is a round that every thread joins, even if there's nothing left for it
+ * to do, so that none of them is still looking at a job once it's over.
+ */
+static struct {
+  bool started;
+  int nthreads;     /* helper threads running */
+  uint round;
+  decode_job *job;
+  int joined, busy;
+  pthread_mutex_t mutex;
+  pthread_cond_t start, finished;
+} pool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+          .start = PTHREAD_COND_INITIALIZER,
+          .finished = PTHREAD_COND_INITIALIZER};
+
+static void *
+pool_thread(void *unused)
+{
+  (void)unused;
+  uint round = 0;
+  pthread_mutex_lock(&pool.mutex);
+  for (;;) {
+    while (pool.round == round)
+      pthread_cond_wait(&pool.start, &pool.mutex);
+    round = pool.round;
+    decode_job *job = pool.job;
+    pool.joined++;
+    pool.busy++;
+    pthread_mutex_unlock(&pool.mutex);
+    decode_lines(job);
+    pthread_mutex_lock(&pool.mutex);
+    pool.busy--;
+    pthread_cond_signal(&pool.finished);
+  }
+  return 0;
+}
+
+/*
+ * Make sure that a range of rows of the scrollback, with y as for
+ * scrollback_fetch(), is in the cache, decoding the missing ones on
+ * several threads if there are enough of them. This is for jumping to
+ * another part of the scrollback, where fetching row after row would
+ * unpack and decompress everything on this thread.
+ */
+void
+scrollback_prefetch(int y, int rows)
+{
+  long long start = max(sb.end + y, sb_start());
+  long long end = min(sb.end + y + rows, hot_start());
+  end = min(end, start + SB_CACHE_SIZE / 2);
+  if (end - start < SB_DECODE_MIN)
+    return;
+
+  int missing = 0;
+  for (long long n = start; n < end; n++)
+    missing += !cache_find(n);
+  if (missing < SB_DECODE_MIN)
+    return;
+
+  if (!pool.started) {
+    pool.started = true;
+    int n = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), SB_DECODE_THREADS);
+    for (int i = 1; i < n; i++) {
+      pthread_t thread;
+      if (!pthread_create(&thread, null, pool_thread, null)) {
+        pthread_detach(thread);
+        pool.nthreads++;
+      }
+    }
+  }
+  if (!pool.nthreads)
+    return;
+  int nthreads = pool.nthreads + 1;
+
+  // Split the missing lines into a slice per thread, or more where they
+  // span blocks. Data that is at hand is passed on, but spilled blocks
+  // are left to the threads, as mapping them would move other mappings.
+  decode_slice slices[missing];
+  termline *lines[end - start];
+  int per = (missing + nthreads - 1) / nthreads, nslices = 0;
+  sbblock *b = null;
+  for (long long n = start; n < end; n++) {
+    lines[n - start] = null;
+    if (cache_find(n))
+      continue;
+    if (!b || n >= b->first + b->lines)
+      b = find_block(n);
+    decode_slice *s = nslices ? &slices[nslices - 1] : null;
+    if (s && s->block == b && s->end == n && s->end - s->start < per)
+      s->end++;
+    else {
+      uchar *data = null;
+      if (b->spilled < 0 && !b->packed)
+        data = b->data;
+      for (uint i = 0; i < lengthof(unpacked) && b->spilled < 0; i++) {
+        if (unpacked[i].block == b)
+          data = unpacked[i].data;
+      }
+      slices[nslices++] = (decode_slice){
+        .block = b, .data = data, .ends = data ? b->ends : null,
+        .start = n, .end = n + 1
+      };
+    }
+  }
+
+  decode_job job = {
+    .slices = slices, .nslices = nslices, .next = 0,
+    .first = start, .lines = lines
+  };
+  pthread_mutex_lock(&pool.mutex);
+  pool.job = &job;
+  pool.round++;
+  pool.joined = 0;
+  pthread_cond_broadcast(&pool.start);
+  pthread_mutex_unlock(&pool.mutex);
+  decode_lines(&job);
+  pthread_mutex_lock(&pool.mutex);
+  while (pool.joined < pool.nthreads || pool.busy)
+    pthread_cond_wait(&pool.finished, &pool.mutex);
+  pthread_mutex_unlock(&pool.mutex);
+
+  for (long long n = start; n < end; n++) {
+    if (lines[n - start])
+      cache_add(n, lines[n - start]);
+  }
+}
+
+/*
+ * Start or stop sharing the scrollback with another thread, which may
+ * then call scrollback_read(). While it's shared, lines that are already
+ * in it aren't moved back to the screen, so that their numbers stay valid.
+ */
+void
+scrollback_share(bool shared)
+{
+  if (shared)
+    term.tempsblines = 0;
+  sb.shared = shared;
+}
+
+/*
+ * Replace the references to shared lines in a block that has been loaded
+ * with copying, as the reading thread can't get at the shared lines.
+ */
+static void
+resolve_refs(sbbuffer *buf, uint lines, uchar **data, uint *ends)
+{
+  uint size = 0;
+  for (uint j = 0; j < lines; j++) {
+    uint start = j ? ends[j - 1] : 0;
+    uchar *p = *data + start;
+    size += is_ref(p) ? sentry(ref_id(p)).len : ends[j] - start;
+  }
+  if (buf->resolved_size < size) {
+    free(buf->resolved);
+    buf->resolved = newn(uchar, size);
+    buf->resolved_size = size;
+  }
+
+  uint start = 0, pos = 0;
+  for (uint j = 0; j < lines; j++) {
+    uchar *p = *data + start;
+    uint len = is_ref(p) ? sentry(ref_id(p)).len : ends[j] - start;
+    memcpy(buf->resolved + pos, line_data(p), len);
+    start = ends[j];
+    pos += len;
+    ends[j] = pos;
+  }
+  *data = buf->resolved;
+}
+
+/*
+ * Compress the lines of the hot tier from line number n on into a buffer,
+ * like a block.
+ */
+static void
+read_hot(sbbuffer *buf, long long n, uchar **data, uint **ends)
+{
+  uint lines = sb.end - n;
+  if (buf->stored_size < lines * sizeof(uint)) {
+    free(buf->stored);
+    buf->stored = newn(uchar, lines * sizeof(uint));
+    buf->stored_size = lines * sizeof(uint);
+  }
+  uint *e = (uint *)buf->stored;
+  uint used = 0;
+  for (uint j = 0; j < lines; j++) {
+    uint len = compressline(hot_line(n + j), &sb.buf, &sb.bufsize);
+    if (buf->unpacked_size < used + len) {
+      buf->unpacked_size = max(buf->unpacked_size * 2, used + len);
+      buf->unpacked = renewn(buf->unpacked, buf->unpacked_size);
+    }
+    memcpy(buf->unpacked + used, sb.buf, len);
+    used += len;
+    e[j] = used;
+  }
+  *data = buf->unpacked;
+  *ends = e;
+}
+
+/*
+ * Read the block holding line number n, or if that's gone, the oldest
+ * block still stored, into a buffer while the scrollback is shared.
+ * Lines in the hot tier are read as if they were in a block of their own.
+ * Returns the number of the first line of the block, with its unpacked
+ * data and line ends in *data and *ends and the number of its lines in
+ * *lines, or -1 if there are no lines from n on or reading failed.
+ */
+long long
+scrollback_read(long long n, sbbuffer *buf,
+                uchar **data, uint **ends, uint *lines)
+{
+  pthread_mutex_lock(&sb.mutex);
+  long long first = -1;
+  n = max(n, sb_start());
+  if (n >= hot_start() && n < sb.end) {
+    read_hot(buf, n, data, ends);
+    first = n;
+    *lines = sb.end - n;
+  }
+  else if (n < sb.end) {
+    sbblock *b = find_block(n);
+    if (load_block(buf, b, true, data, ends)) {
+      if (b->refs)
+        resolve_refs(buf, b->lines, data, *ends);
+      first = b->first;
+      *lines = b->lines;
+    }
+  }
+  pthread_mutex_unlock(&sb.mutex);
+  return first;
+}
+
+void
+scrollback_free_buffer(sbbuffer *buf)
+{
+  free(buf->stored);
+  free(buf->unpacked);
+  free(buf->resolved);
+}
+
+/*
+ * Number of the scrollback or screen line at y. Unlike y, it stays the
+ * same as lines move into the scrollback.
+ */
+long long
+line_number(int y)
+{ return sb.end + y; }
+
+/*
+ * Report the number of bytes taken up by the scrollback in memory and in
+ * the spill file. The cache of decompressed lines isn't included.
+ */
+void
+scrollback_usage(long long *memory, long long *filed)
+{
+  *memory = sb.memory;
+  *filed = sb.filed;
+}
+
+/*
+ * Session files.
+ *
+ * A session file starts with a header and a table of the blocks with
+ * their summaries, and the shared lines the blocks refer to, followed by
+ * the blocks, laid out like in the spill file, so that they can be
+ * restored by mapping the file and taking it as the place the blocks have
+ * been spilled to. The shared lines are read in, as they are few.
+ */
+#define SESSION_VERSION 3
+
+typedef struct {
+  char magic[8];
+  uint version;
+  uint nblocks;
+  uint skip;        /* lines of the first block that had been evicted */
+  uint nshared;     /* number of shared lines */
+  uint shared_size; /* bytes of shared line data */
+  uint shared_check;  /* hash of the shared line hashes */
+} session_header;
+
+typedef struct {
+  uint seg, offset; /* where the block is */
+  uint lines, used, packed;
+  uint refs;        /* number of references to shared lines */
+  uint check;       /* see block_check() */
+} session_block;
+
+typedef struct {
+  uint id, len, refs;
+} session_shared;
+
+static const char session_magic[8] = "mintty\0S";
+
+static bool
+write_all(int fd, const void *data, size_t len, off_t pos)
+{ return pwrite(fd, data, len, pos) == (ssize_t)len; }
+
+/*
+ * Save the scrollback to a session file, together with the lines on the
+ * primary screen, which end up at the bottom of the scrollback when the
+ * session is restored. This is for when the terminal goes away, as it
+ * moves the screen lines into the scrollback.
+ */
+void
+term_save_session(string path)
+{
+  termline **lines = term.on_alt_screen ? term.other_lines : term.lines;
+  int origin =
+    term.on_alt_screen ? term.other_lines_origin : term.lines_origin;
+  int rows = term.rows;
+  while (rows > 0) {
+    termline *line = lines[ring_row(origin, rows - 1)];
+    int cols = line->blank ? 1 : line->cols;
+    int x = 0;
+    while (x < cols && termchars_equal(&line->chars[x], &term.erase_char))
+      x++;
+    if (x < cols)
+      break;
+    rows--;
+  }
+  if (cfg.scrollback_lines) {
+    for (int y = 0; y < rows; y++) {
+      termline **line = &lines[ring_row(origin, y)];
+      *line = scrollback_push(*line);
+      clearline(*line);
+    }
+  }
+
+  // Only blocks are saved.
+  sb_lock();
+  flush_hot();
+  sb_unlock();
+
+  if (!term.sblines) {
+    unlink(path);
+    return;
+  }
+
+  char *temp_path = asform("%s.new", path);
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    free(temp_path);
+    return;
+  }
+
+  uint nblocks = sb.nblocks;
+  uint summary_size = (1 << SB_SUMMARY_BITS) / 8;
+  long long pos = sizeof(session_header) +
+                  nblocks * (sizeof(session_block) + summary_size);
+
+  // The shared lines come after the summaries, with their data after
+  // their table.
+  uint nshared = 0, shared_size = 0, shared_check = 0;
+  session_shared *shared_table = newn(session_shared, shared.count + 1);
+  for (uint i = 1; i <= shared.top; i++) {
+    if (sentry(i).refs) {
+      shared_table[nshared++] = (session_shared){
+        .id = i, .len = sentry(i).len, .refs = sentry(i).refs
+      };
+      shared_size += sentry(i).len;
+      shared_check = shared_check * 31 + sentry(i).hash;
+    }
+  }
+  bool ok = write_all(fd, shared_table, nshared * sizeof(session_shared), pos);
+  pos += nshared * sizeof(session_shared);
+  for (uint i = 0; i < nshared && ok; i++) {
+    ok = write_all(fd, sentry(shared_table[i].id).data, shared_table[i].len,
+                   pos);
+    pos += shared_table[i].len;
+  }
+  free(shared_table);
+
+  session_block *table = newn(session_block, nblocks);
+  for (uint i = 0; i < nblocks && ok; i++) {
+    sbblock *b = sb.blocks[i];
+    uint total = spilled_ends_offset(b) + b->lines * sizeof(uint);
+    if (total > SPILL_SEGMENT_SIZE)
+      ok = false;
+    else {
+      // Blocks don't straddle segments.
+      if (pos % SPILL_SEGMENT_SIZE + total > SPILL_SEGMENT_SIZE)
+        pos += SPILL_SEGMENT_SIZE - pos % SPILL_SEGMENT_SIZE;
+      uchar *data = stored_data(b);
+      uint *ends = block_ends(b);
+      // Restored blocks keep their hash, so that damage isn't covered up.
+      table[i] = (session_block){
+        .seg = pos / SPILL_SEGMENT_SIZE, .offset = pos % SPILL_SEGMENT_SIZE,
+        .lines = b->lines, .used = b->used, .packed = b->packed,
+        .refs = b->refs,
+        .check = b->restored || !data || !ends
+                 ? b->check : block_check(b, data, ends)
+      };
+      ok = data && ends &&
+           write_all(fd, data, b->packed ?: b->used, pos) &&
+           write_all(fd, ends, b->lines * sizeof(uint),
+                     pos + spilled_ends_offset(b)) &&
+           write_all(fd, b->summary, summary_size,
+                     sizeof(session_header) + nblocks * sizeof(session_block)
+                     + i * summary_size);
+      pos += total;
+    }
+  }
+
+  session_header header = {
+    .version = SESSION_VERSION, .nblocks = nblocks,
+    .skip = sb_start() - sb.blocks[0]->first,
+    .nshared = nshared, .shared_size = shared_size,
+    .shared_check = shared_check
+  };
+  memcpy(header.magic, session_magic, sizeof header.magic);
+  ok = ok &&
+       write_all(fd, table, nblocks * sizeof(session_block),
+                 sizeof header) &&
+       write_all(fd, &header, sizeof header, 0);
+  free(table);
+
+  if (close(fd) < 0 || !ok || rename(temp_path, path) < 0)
+    unlink(temp_path);
+  free(temp_path);
+}
+
+/*
+ * Restore the scrollback from a session file. The file is mapped as
+ * needed rather than read, so this is quick however big it is. Returns
+ * whether that worked.
+ */
+bool
+term_load_session(string path)
+{
+  if (term.sblines)
+    return false;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  session_header header;
+  if (fstat(fd, &st) < 0 ||
+      pread(fd, &header, sizeof header, 0) != sizeof header ||
+      memcmp(header.magic, session_magic, sizeof header.magic) ||
+      header.version != SESSION_VERSION || !header.nblocks ||
+      header.nblocks > (st.st_size - sizeof header) / sizeof(session_block)) {
+    close(fd);
+    return false;
+  }
+
+  uint nblocks = header.nblocks;
+  uint summary_size = (1 << SB_SUMMARY_BITS) / 8;
+  session_block *table = newn(session_block, nblocks);
+  uchar *summaries = newn(uchar, (size_t)nblocks * summary_size);
+  bool ok =
+    pread(fd, table, nblocks * sizeof *table, sizeof header)
+      == (ssize_t)(nblocks * sizeof *table) &&
+    pread(fd, summaries, (size_t)nblocks * summary_size,
+          sizeof header + nblocks * sizeof *table)
+      == (ssize_t)((size_t)nblocks * summary_size);
+
+  // Check that the blocks are where they ought to be.
+  uint nsegs = 0;
+  for (uint i = 0; i < nblocks && ok; i++) {
+    session_block *t = &table[i];
+    sbblock probe = {.lines = t->lines, .used = t->used, .packed = t->packed};
+    long long end = (long long)t->seg * SPILL_SEGMENT_SIZE + t->offset +
+                    spilled_ends_offset(&probe) + t->lines * sizeof(uint);
+    ok = t->lines && t->used && t->packed <= t->used &&
+         t->offset + spilled_ends_offset(&probe) + t->lines * sizeof(uint)
+           <= SPILL_SEGMENT_SIZE &&
+         end <= st.st_size;
+    nsegs = max(nsegs, t->seg + 1);
+  }
+  ok = ok && header.skip < table[0].lines;
+
+  // Read the shared lines, checking that they add up.
+  uint nshared = header.nshared;
+  long long pos = sizeof header + nblocks * (sizeof *table + summary_size);
+  session_shared *shared_table = null;
+  uchar *shared_data = null;
+  if (ok && nshared) {
+    ok = nshared <= header.shared_size / 3 &&
+         pos + (long long)(nshared * sizeof *shared_table) +
+           header.shared_size <= (long long)st.st_size;
+    if (ok) {
+      shared_table = newn(session_shared, nshared);
+      shared_data = newn(uchar, header.shared_size);
+      ok = pread(fd, shared_table, nshared * sizeof *shared_table, pos)
+             == (ssize_t)(nshared * sizeof *shared_table) &&
+           pread(fd, shared_data, header.shared_size,
+                 pos + nshared * sizeof *shared_table)
+             == (ssize_t)header.shared_size;
+    }
+    uint size = 0, check = 0;
+    for (uint i = 0; i < nshared && ok; i++) {
+      session_shared *t = &shared_table[i];
+      ok = t->id && t->id < 1 << 24 && t->refs && t->len >= 3 &&
+           t->len <= header.shared_size - size &&
+           (!i || t->id > t[-1].id);
+      if (ok)
+        check = check * 31 + hash_bytes(shared_data + size, t->len);
+      size += t->len;
+    }
+    ok = ok && size == header.shared_size && check == header.shared_check;
+  }
+
+  FILE *file = ok ? fdopen(fd, "r") : null;
+  if (!file) {
+    free(table);
+    free(summaries);
+    free(shared_table);
+    free(shared_data);
+    close(fd);
+    return false;
+  }
+
+  close_block_file(&session);
+  session.file = file;
+  session.nsegs = nsegs;
+  session.segs = newn(typeof(*session.segs), nsegs);
+
+  sb_lock();
+  clear_shared();
+  if (nshared) {
+    shared.top = shared_table[nshared - 1].id;
+    shared.size = shared.top + 1;
+    shared.entries = newn(typeof(*shared.entries), shared.size);
+    uchar *data = shared_data;
+    for (uint i = 0; i < nshared; i++) {
+      session_shared *t = &shared_table[i];
+      sentry(t->id).data = memcpy(newn(uchar, t->len), data, t->len);
+      sentry(t->id).len = t->len;
+      sentry(t->id).hash = hash_bytes(data, t->len);
+      sentry(t->id).refs = t->refs;
+      shared.count++;
+      link_shared(t->id);
+      sb.memory += sizeof *shared.entries + t->len;
+      data += t->len;
+    }
+    // Unused numbers go into the free list.
+    for (uint id = shared.top; id; id--) {
+      if (!sentry(id).refs) {
+        sentry(id).next = shared.free;
+        shared.free = id;
+      }
+    }
+  }
+  free(shared_table);
+  free(shared_data);
+
+  if (sb.size < (int)nblocks) {
+    sb.size = nblocks;
+    sb.blocks = renewn(sb.blocks, sb.size);
+  }
+  for (uint i = 0; i < nblocks; i++) {
+    session_block *t = &table[i];
+    sbblock *b = sb.blocks[sb.nblocks++] = new(sbblock);
+    *b = (sbblock){
+      .first = sb.end, .lines = t->lines,
+      .used = t->used, .size = t->used, .packed = t->packed,
+      .ends_size = t->lines,
+      .spilled = (long long)t->seg * SPILL_SEGMENT_SIZE + t->offset,
+      .restored = true, .refs = t->refs, .check = t->check,
+      .summary = memcpy(newn(uint, summary_size / sizeof(uint)),
+                        summaries + i * summary_size, summary_size)
+    };
+    session.segs[t->seg].blocks++;
+    count_block(b, +1);
+    sb.end += b->lines;
+    term.sblines += b->lines;
+  }
+  free(table);
+  free(summaries);
+
+  // Evicted lines stay evicted, and the limits still apply.
+  term.sblines -= header.skip;
+  while (term.sblines > cfg.scrollback_lines)
+    drop_oldest();
+  keep_to_size();
+  sb_unlock();
+  return true;
+}
+
+/*
+ * Clear the scrollback.
+ */
+void
+term_clear_scrollback(void)
+{
+  scrollback_uncache();
+  sb_lock();
+  while (hot.count) {
+    if (queued())
+      finish_job();
+    freeline(take_oldest_hot());
+  }
+  while (sb.nblocks)
+    free_block(sb.blocks[--sb.nblocks]);
+  clear_shared();
+  term.sblines = 0;
+  term.tempsblines = 0;
+  term.disptop = 0;
+
+  // Get rid of the spill file, and the session file if it was restored.
+  close_block_file(&spill);
+  close_block_file(&session);
+  sb_unlock();
+}
@@ -0,0 +1,789 @@
+// termsearch.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "termpriv.h"
+
+#include "win.h"
+
+#include <regex.h>
+
+/*
+ * Incremental search.
+ *
+ * The scrollback is searched outwards from the top of the view as it was
+ * when the search started, in both directions, a slice at a time on a
+ * timer. This keeps typing into the search bar responsive however long
+ * the scrollback is. Matches are recorded with their line numbers (see
+ * line_number()), which don't change as further lines are added. Matches
+ * found going up are kept apart from those found going down, so both
+ * lists stay sorted without inserting anything in the middle.
+ *
+ * Lines that scroll into the scrollback during the search get searched
+ * when they get there. Screen lines can still change, so their matches
+ * aren't recorded but looked for when needed, as are those of the rows
+ * being painted.
+ *
+ * When a character is added to the search text, only the lines that
+ * matched the old text can match the new one, so those are searched again
+ * before carrying on with lines that haven't been searched yet.
+ *
+ * Matching ignores case and doesn't carry on across line ends. Lines in
+ * scrollback blocks whose summaries lack the trigrams of the search text
+ * are skipped without decompressing them.
+ *
+ * Regular expression search.
+ *
+ * Alternatively, the whole scrollback can be searched for a POSIX extended
+ * regular expression in one go, on as many threads as there are
+ * processors, while the rest of the terminal waits. Lines are converted
+ * to UTF-8 for matching. Blocks are skipped if their summaries lack the
+ * trigrams of strings that every match has to contain. Lines that reach
+ * the scrollback afterwards are searched when stepping through the
+ * matches gets to them.
+ */
+
+#define SEARCH_SLICE 20     /* milliseconds of searching per timer tick */
+#define SEARCH_CHUNK 256    /* lines searched between looks at the clock */
+#define SEARCH_THREADS 16   /* maximum number of threads */
+#define SEARCH_TRIGRAMS 16  /* maximum number of trigrams to check */
+
+typedef struct {
+  long long y;  /* line number */
+  int x, end;   /* first column and the column after the match */
+} match;
+
+typedef struct {
+  match *items;
+  int n, size;
+} matchlist;
+
+typedef struct {
+  int step;         /* -1 for searching up, +1 for down */
+  matchlist found;  /* matches found, in the order they were found */
+  match *old;       /* matches of a shorter search text, still to be checked */
+  int nold, iold;
+  long long next;   /* line to search once the old matches are done */
+} searchdir;
+
+static struct {
+  wchar *text;      /* folded search text, or null if not searching */
+  int len;
+  uint trigrams[SEARCH_TRIGRAMS];
+  int ntrigrams;
+  searchdir up, down;
+  long long end;    /* line_number(0) when last looked at */
+  bool scheduled;
+  bool current;     /* whether cur is set */
+  match cur;        /* match last moved to */
+} search = {.up = {.step = -1}, .down = {.step = +1}};
+
+/*
+ * Regular expression matching state. Each thread needs its own, as
+ * regexec() isn't guaranteed to be able to run on the same pattern in
+ * several threads at once.
+ */
+typedef struct {
+  regex_t re;
+  matchlist found;
+  char *text;       /* line in UTF-8 */
+  ushort *cols;     /* column of each byte of text */
+  int size;
+} grepper;
+
+static struct {
+  bool on;
+  matchlist found;  /* matches in the scrollback, in order */
+  long long end;    /* first line that hadn't reached the scrollback yet */
+  grepper main;     /* for use by the main thread */
+} grep;
+
+static void
+add_match(matchlist *ml, long long y, int x, int end)
+{
+  if (ml->n == ml->size) {
+    ml->size = ml->size * 2 + 256;
+    ml->items = renewn(ml->items, ml->size);
+  }
+  ml->items[ml->n++] = (match){.y = y, .x = x, .end = end};
+}
+
+/*
+ * If the search text is found at column x of a line, return the column
+ * after it, otherwise 0. Right halves of wide characters are skipped.
+ */
+static int
+match_at(termline *line, int x)
+{
+  termchar *chars = line->chars;
+  int cols = line->cols;
+  if (chars[x].chr == UCSWIDE || fold_char(chars[x].chr) != search.text[0])
+    return 0;
+  for (int i = 1; i < search.len; i++) {
+    while (++x < cols && chars[x].chr == UCSWIDE);
+    if (x >= cols || fold_char(chars[x].chr) != search.text[i])
+      return 0;
+  }
+  while (++x < cols && chars[x].chr == UCSWIDE);
+  return x;
+}
+
+static void
+text_matches(termline *line, long long y, matchlist *ml)
+{
+  for (int x = 0; x < line->cols; x++) {
+    int end = match_at(line, x);
+    if (end)
+      add_match(ml, y, x, end);
+  }
+}
+
+static void
+regex_matches(termline *line, long long y, grepper *g)
+{
+  // Each UTF-16 character takes up to three bytes.
+  int size = line->size * 3 + 4;
+  if (g->size < size) {
+    free(g->text);
+    free(g->cols);
+    g->text = newn(char, size);
+    g->cols = newn(ushort, size);
+    g->size = size;
+  }
+
+  // Blanks at the end are left out, like in stored scrollback lines, so
+  // that $ matches the same whether a line has been compressed or not.
+  int cols = line->cols;
+  while (cols > 0 && line->chars[cols - 1].chr == ' ' &&
+         line->chars[cols - 1].attr == ATTR_DEFAULT &&
+         !line->chars[cols - 1].cc_next)
+    cols--;
+
+  // Combining characters are included, so that surrogate pairs come out
+  // right, and so do patterns that mention them.
+  char *p = g->text;
+  for (int x = 0; x < cols; x++) {
+    termchar *d = &line->chars[x];
+    if (d->chr == UCSWIDE)
+      continue;
+    char *q = p;
+    wchar hs = 0;
+    p = put_utf16(p, d->chr, &hs);
+    while (d->cc_next) {
+      d += d->cc_next;
+      p = put_utf16(p, d->chr, &hs);
+    }
+    if (hs)
+      p = put_utf8(p, hs);
+    while (q < p)
+      g->cols[q++ - g->text] = x;
+  }
+  *p = 0;
+
+  int len = p - g->text, off = 0;
+  regmatch_t rm;
+  while (off < len &&
+         !regexec(&g->re, g->text + off, 1, &rm, off ? REG_NOTBOL : 0)) {
+    int so = off + rm.rm_so, eo = off + rm.rm_eo;
+    if (eo > so) {
+      int end = g->cols[eo - 1] + 1;
+      while (end < line->cols && line->chars[end].chr == UCSWIDE)
+        end++;
+      add_match(&g->found, y, g->cols[so], end);
+      off = eo;
+    }
+    else
+      off = so + 1;
+  }
+}
+
+/* Find the matches of the current search in a line. */
+static void
+line_matches(termline *line, long long y, matchlist *ml)
+{
+  if (grep.on) {
+    grep.main.found.n = 0;
+    regex_matches(line, y, &grep.main);
+    for (int i = 0; i < grep.main.found.n; i++) {
+      match *m = &grep.main.found.items[i];
+      add_match(ml, m->y, m->x, m->end);
+    }
+  }
+  else
+    text_matches(line, y, ml);
+}
+
+/* Record the matches in scrollback line n. */
+static void
+search_line(searchdir *d, long long n)
+{
+  if (search.ntrigrams &&
+      !scrollback_may_contain(n, search.trigrams, search.ntrigrams))
+    return;
+
+  termline *line = scrollback_peek(n - search.end);
+  int first = d->found.n;
+  text_matches(line, n, &d->found);
+  release_line(line);
+
+  // Going up, the matches on a line have to be recorded right to left.
+  if (d->step < 0) {
+    match *items = d->found.items;
+    for (int i = first, j = d->found.n - 1; i < j; i++, j--) {
+      match m = items[i];
+      items[i] = items[j];
+      items[j] = m;
+    }
+  }
+}
+
+/*
+ * Search another line in one direction, preferring lines with matches of
+ * a shorter search text. Return false if there is nothing left to do.
+ */
+static bool
+search_more(searchdir *d)
+{
+  long long start = search.end - term.sblines;
+  while (d->iold < d->nold) {
+    long long n = d->old[d->iold].y;
+    while (d->iold < d->nold && d->old[d->iold].y == n)
+      d->iold++;
+    if (n >= start) {
+      search_line(d, n);
+      return true;
+    }
+  }
+  if (d->old) {
+    free(d->old);
+    d->old = null;
+    d->nold = d->iold = 0;
+  }
+  if (d->step > 0 && d->next < start)
+    d->next = start;  // skip lines evicted before getting searched
+  if (d->step < 0 ? d->next < start : d->next >= search.end)
+    return false;
+  search_line(d, d->next);
+  d->next += d->step;
+  return true;
+}
+
+/* The line from which on the search hasn't got to yet in a direction. */
+static long long
+frontier(searchdir *d)
+{ return d->iold < d->nold ? d->old[d->iold].y : d->next; }
+
+static void
+clear_dir(searchdir *d, long long next)
+{
+  free(d->old);
+  d->old = null;
+  d->nold = d->iold = d->found.n = 0;
+  d->next = next;
+}
+
+/* Start searching from the top of the view. */
+static void
+restart(void)
+{
+  long long top = line_number(term.disptop);
+  clear_dir(&search.up, top - 1);
+  clear_dir(&search.down, top);
+  search.end = line_number(0);
+  search.current = false;
+}
+
+/*
+ * Catch up with lines having been added to or evicted from the
+ * scrollback. If lines have gone back to the screen on resizing, their
+ * numbers are going to be reused, so the search starts over.
+ */
+static void
+catch_up(void)
+{
+  long long end = line_number(0);
+  if (end < search.end) {
+    restart();
+    while (grep.found.n && grep.found.items[grep.found.n - 1].y >= end)
+      grep.found.n--;
+    grep.end = min(grep.end, end);
+    return;
+  }
+  search.end = end;
+
+  long long start = end - term.sblines;
+  matchlist *ml = &search.up.found;
+  while (ml->n && ml->items[ml->n - 1].y < start)
+    ml->n--;
+  ml = &search.down.found;
+  int i = 0;
+  while (i < ml->n && ml->items[i].y < start)
+    i++;
+  if (i) {
+    ml->n -= i;
+    memmove(ml->items, ml->items + i, ml->n * sizeof *ml->items);
+  }
+}
+
+/*
+ * Prepare for the search text getting longer. Only lines with matches of
+ * the old text need searching again, starting with those already done.
+ */
+static void
+refine(searchdir *d)
+{
+  int nold = d->found.n + d->nold - d->iold;
+  match *old = newn(match, max(nold, 1));
+  memcpy(old, d->found.items, d->found.n * sizeof *old);
+  memcpy(old + d->found.n, d->old + d->iold, (d->nold - d->iold) * sizeof *old);
+  free(d->old);
+  d->old = old;
+  d->nold = nold;
+  d->iold = d->found.n = 0;
+}
+
+static void schedule(void);
+
+static void
+search_step(void)
+{
+  search.scheduled = false;
+  if (!search.text)
+    return;
+  catch_up();
+  int deadline = get_tick_count() + SEARCH_SLICE;
+  bool more = true;
+  while (more && deadline - get_tick_count() > 0) {
+    for (int i = 0; more && i < SEARCH_CHUNK; i++)
+      more = search_more(&search.up) | search_more(&search.down);
+  }
+  if (more)
+    schedule();
+}
+
+static void
+schedule(void)
+{
+  if (!search.scheduled) {
+    search.scheduled = true;
+    win_set_timer(search_step, 1);
+  }
+}
+
+static void
+end_regex(void)
+{
+  if (grep.on) {
+    regfree(&grep.main.re);
+    grep.on = false;
+  }
+  grep.found.n = 0;
+}
+
+/*
+ * Set the search text, or stop searching if it is null or empty. Matches
+ * are highlighted, and term_search_next() moves to them.
+ */
+void
+term_set_search(wchar *text)
+{
+  int len = text ? wcslen(text) : 0;
+  wchar folded[len + 1];
+  for (int i = 0; i < len; i++)
+    folded[i] = fold_char(text[i]);
+
+  disprows_invalidate(0, term.rows - 1);
+  end_regex();
+
+  if (!len) {
+    free(search.text);
+    search.text = null;
+    search.len = 0;
+    clear_dir(&search.up, 0);
+    clear_dir(&search.down, 0);
+    return;
+  }
+
+  if (search.text && len > search.len &&
+      !wmemcmp(folded, search.text, search.len)) {
+    catch_up();
+    refine(&search.up);
+    refine(&search.down);
+  }
+  else
+    restart();
+
+  free(search.text);
+  search.text = newn(wchar, len);
+  wmemcpy(search.text, folded, len);
+  search.len = len;
+  search.ntrigrams = 0;
+  for (int i = 2; i < len && search.ntrigrams < SEARCH_TRIGRAMS; i++) {
+    search.trigrams[search.ntrigrams++] =
+      trigram(folded[i - 2], folded[i - 1], folded[i]);
+  }
+  search.current = false;
+  schedule();
+}
+
+/*
+ * Find trigrams of strings that any match of a regular expression has to
+ * contain, erring on the side of finding too few.
+ */
+static int
+required_trigrams(const wchar *pattern, uint *trigrams, int max)
+{
+  int n = 0, len = 0, depth = 0;
+  wchar run[wcslen(pattern) + 1];
+  void end_run(void) {
+    for (int i = 2; i < len && n < max; i++)
+      trigrams[n++] = trigram(run[i - 2], run[i - 1], run[i]);
+    len = 0;
+  }
+
+  // Alternatives would need more thought.
+  if (wcschr(pattern, '|'))
+    return 0;
+
+  for (const wchar *p = pattern; *p; p++) {
+    wchar c = *p;
+    switch (c) {
+      when '\\':
+        c = *++p;
+        if (!c)
+          return 0;
+        if (iswalnum(c)) {
+          end_run();
+          continue;
+        }
+      when '[':
+        end_run();
+        if (*++p == '^')
+          p++;
+        if (*p == ']')
+          p++;
+        while (*p != ']') {
+          if (!*p)
+            return 0;
+          if (*p == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            wchar kind = p[1];
+            for (p += 2; !(p[0] == kind && p[1] == ']'); p++) {
+              if (!*p)
+                return 0;
+            }
+            p++;
+          }
+          p++;
+        }
+        continue;
+      when '(':
+        end_run();
+        depth++;
+        continue;
+      when ')':
+        end_run();
+        depth--;
+        continue;
+      when '.' or '^' or '$' or '+':
+        end_run();
+        continue;
+      when '*' or '?' or '{':
+        // The character before is optional.
+        if (len)
+          len--;
+        end_run();
+        if (c == '{') {
+          while (*p != '}') {
+            if (!*++p)
+              return 0;
+          }
+        }
+        continue;
+    }
+    if (!depth)
+      run[len++] = fold_char(c);
+  }
+  end_run();
+  return n;
+}
+
+static void
+grep_line(void *arg, long long n, termline *line)
+{ regex_matches(line, n, arg); }
+
+static int
+compare_matches(const void *p1, const void *p2)
+{
+  const match *m1 = p1, *m2 = p2;
+  if (m1->y != m2->y)
+    return m1->y < m2->y ? -1 : 1;
+  return m1->x - m2->x;
+}
+
+/*
+ * Search the whole scrollback for a regular expression, ending any
+ * other search. Matches on the screen are highlighted, and
+ * term_search_next() moves to them. Return the number of matches in the
+ * scrollback, or -1 if the pattern is invalid.
+ */
+int
+term_search_regex(wchar *pattern)
+{
+  term_set_search(null);
+
+  int len = wcslen(pattern);
+  char re[len * 3 + 1], *p = re;
+  wchar hs = 0;
+  for (int i = 0; i < len; i++)
+    p = put_utf16(p, pattern[i], &hs);
+  if (hs)
+    p = put_utf8(p, hs);
+  *p = 0;
+
+  int flags = REG_EXTENDED | REG_ICASE;
+  if (regcomp(&grep.main.re, re, flags))
+    return -1;
+  grep.on = true;
+  catch_up();
+  search.current = false;
+  grep.end = search.end;
+
+  uint trigrams[SEARCH_TRIGRAMS];
+  int ntrigrams = required_trigrams(pattern, trigrams, lengthof(trigrams));
+
+  int nthreads = min(max(sysconf(_SC_NPROCESSORS_ONLN), 1), SEARCH_THREADS);
+  grepper greppers[nthreads];
+  void *args[nthreads];
+  for (int i = 0; i < nthreads; i++) {
+    grepper *g = &greppers[i];
+    *g = (grepper){.size = 0};
+    regcomp(&g->re, re, flags);
+    args[i] = g;
+  }
+  scrollback_scan(trigrams, ntrigrams, grep_line, args, nthreads);
+
+  // Each thread found its matches in order, but they take turns.
+  grep.found.n = 0;
+  for (int i = 0; i < nthreads; i++) {
+    grepper *g = &greppers[i];
+    for (int j = 0; j < g->found.n; j++) {
+      match *m = &g->found.items[j];
+      add_match(&grep.found, m->y, m->x, m->end);
+    }
+    regfree(&g->re);
+    free(g->found.items);
+    free(g->text);
+    free(g->cols);
+  }
+  qsort(grep.found.items, grep.found.n, sizeof(match), compare_matches);
+  return grep.found.n;
+}
+
+/*
+ * Called before painting. Catch up with changes to the scrollback and
+ * return whether there is a search going on.
+ */
+bool
+search_update(void)
+{
+  if (grep.on)
+    return true;
+  if (!search.text)
+    return false;
+  if (search.end != line_number(0))
+    schedule();
+  return true;
+}
+
+/*
+ * Mark the columns of a line that are part of a match, returning whether
+ * there are any.
+ */
+bool
+search_marks(termline *line, bool *marks)
+{
+  static matchlist ml;
+  ml.n = 0;
+  line_matches(line, 0, &ml);
+  memset(marks, 0, line->cols * sizeof *marks);
+  for (int i = 0; i < ml.n; i++) {
+    match *m = &ml.items[i];
+    memset(marks + m->x, true, (m->end - m->x) * sizeof *marks);
+  }
+  return ml.n;
+}
+
+/*
+ * The matches found in both directions together, from the one with the
+ * lowest line number at index -search.up.found.n to the highest at index
+ * search.down.found.n - 1.
+ */
+static match *
+found(int i)
+{
+  return i < 0 ? &search.up.found.items[-1 - i]
+               : &search.down.found.items[i];
+}
+
+/* Index of the first recorded match after column x of line y. */
+static int
+found_after(long long y, int x)
+{
+  int lo = -search.up.found.n, hi = search.down.found.n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    match *m = found(mid);
+    if (m->y < y || (m->y == y && m->x <= x))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Index of the first match in an ordered list after column x of line y. */
+static int
+list_after(matchlist *ml, long long y, int x)
+{
+  int lo = 0, hi = ml->n;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    match *m = &ml->items[mid];
+    if (m->y < y || (m->y == y && m->x <= x))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/*
+ * Look for the first match after column x of line y, or the last one
+ * before it if going backwards, on line n of the scrollback or screen.
+ */
+static bool
+match_on_line(long long n, long long y, int x, bool backwards, match *m)
+{
+  static matchlist ml;
+  ml.n = 0;
+  int ly = n - search.end;
+  termline *line = ly < 0 ? scrollback_peek(ly) : fetch_line(ly);
+  line_matches(line, n, &ml);
+  release_line(line);
+  int i = backwards ? list_after(&ml, y, x - 1) - 1 : list_after(&ml, y, x);
+  if (i < 0 || i >= ml.n)
+    return false;
+  *m = ml.items[i];
+  return true;
+}
+
+/* Find the first match after column x of line y. */
+static bool
+find_next(long long y, int x, match *m)
+{
+  long long start = search.end - term.sblines;
+  if (y < start)
+    y = start, x = -1;
+
+  if (grep.on) {
+    int i = list_after(&grep.found, y, x);
+    if (i < grep.found.n && grep.found.items[i].y < search.end) {
+      *m = grep.found.items[i];
+      return true;
+    }
+    for (long long n = max(y, grep.end); n < search.end; n++) {
+      if (match_on_line(n, y, x, false, m))
+        return true;
+    }
+  }
+  else if (y < search.end) {
+    // Matches between y and the starting point have to be known.
+    while (frontier(&search.up) >= y && search_more(&search.up));
+    for (;;) {
+      int i = found_after(y, x);
+      if (i < search.down.found.n) {
+        *m = *found(i);
+        return true;
+      }
+      if (!search_more(&search.down))
+        break;
+    }
+  }
+
+  for (int sy = max(y - search.end, 0); sy < term.rows; sy++) {
+    if (match_on_line(search.end + sy, y, x, false, m))
+      return true;
+  }
+  return false;
+}
+
+/* Find the last match before column x of line y. */
+static bool
+find_prev(long long y, int x, match *m)
+{
+  for (int sy = min(y - search.end, term.rows - 1); sy >= 0; sy--) {
+    if (match_on_line(search.end + sy, y, x, true, m))
+      return true;
+  }
+
+  long long start = search.end - term.sblines;
+  if (grep.on) {
+    for (long long n = min(y, search.end - 1); n >= max(grep.end, start); n--) {
+      if (match_on_line(n, y, x, true, m))
+        return true;
+    }
+    int i = list_after(&grep.found, y, x - 1) - 1;
+    if (i >= 0 && grep.found.items[i].y >= start) {
+      *m = grep.found.items[i];
+      return true;
+    }
+    return false;
+  }
+
+  while (frontier(&search.down) <= y && search_more(&search.down));
+  for (;;) {
+    int i = found_after(y, x - 1) - 1;
+    if (i >= -search.up.found.n) {
+      *m = *found(i);
+      return true;
+    }
+    if (!search_more(&search.up))
+      return false;
+  }
+}
+
+/*
+ * Select the next match, or the previous one if going backwards, and
+ * scroll it into view. Without a match to go on from, the search goes
+ * from the top of the view, or backwards from its bottom.
+ */
+bool
+term_search_next(bool backwards)
+{
+  if (!search.text && !grep.on)
+    return false;
+  catch_up();
+
+  long long y;
+  int x;
+  if (search.current)
+    y = search.cur.y, x = search.cur.x;
+  else if (backwards)
+    y = line_number(term.disptop + term.rows), x = 0;
+  else
+    y = line_number(term.disptop), x = -1;
+
+  match m;
+  if (!(backwards ? find_prev(y, x, &m) : find_next(y, x, &m)))
+    return false;
+  search.cur = m;
+  search.current = true;
+
+  int my = m.y - search.end;
+  term.selected = true;
+  term.sel_rect = false;
+  term.sel_start = term.sel_anchor = (selpos){.y = m.y, .x = m.x};
+  term.sel_end = (selpos){.y = m.y, .x = m.end};
+  if (my < term.disptop || my >= term.disptop + term.rows)
+    term_scroll(0, my - term.rows / 2 - term.disptop);
+  return true;
+}
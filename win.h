@@ -9,6 +9,7 @@ void win_update(void);
 void win_schedule_update(void);
 
 void win_text(int x, int y, wchar *text, int len, uint attr, int lattr);
+bool win_scroll(int top, int bot, int lines);
 void win_update_mouse(void);
 void win_capture_mouse(void);
 void win_bell(void);
@@ -51,6 +52,7 @@ void win_set_timer(void_fn cb, uint ticks);
 
 void win_show_about(void);
 void win_show_error(wchar *);
+void win_show_progress(int percent);
 
 bool win_is_glass_available(void);
 
@@ -14,6 +14,8 @@
 #include <objidl.h>
 #include <oleidl.h>
 #include <sys/cygwin.h>
+#include <commdlg.h>
+#include <fcntl.h>
 
 static DWORD WINAPI
 shell_exec_thread(void *data)
@@ -61,6 +63,49 @@ win_open(wstring wpath)
   }
 }
 
+/*
+ * Ask for a file to export the scrollback to, with the format chosen by
+ * the file type.
+ */
+void
+win_export(void)
+{
+  if (term_exporting())
+    return;
+
+  wchar wpath[MAX_PATH] = L"";
+  OPENFILENAMEW ofn = {
+    .lStructSize = sizeof ofn,
+    .hwndOwner = wnd,
+    .lpstrFilter =
+      L"Text (*.txt)\0*.txt\0"
+      L"Text with ANSI colours (*.ans)\0*.ans\0"
+      L"HTML (*.html)\0*.html\0",
+    .lpstrFile = wpath,
+    .nMaxFile = lengthof(wpath),
+    .lpstrDefExt = L"txt",
+    .Flags = OFN_OVERWRITEPROMPT | OFN_PATHMUSTEXIST
+  };
+  if (!GetSaveFileNameW(&ofn))
+    return;
+
+#if CYGWIN_VERSION_DLL_MAJOR >= 1007
+  char *path = cygwin_create_path(CCP_WIN_W_TO_POSIX, wpath);
+#else
+  char win_path[MAX_PATH], *path = newn(char, MAX_PATH);
+  WideCharToMultiByte(0, 0, wpath, -1, win_path, MAX_PATH, 0, 0);
+  cygwin_conv_to_posix_path(win_path, path);
+#endif
+  int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+  free(path);
+  if (fd < 0)
+    MessageBox(0, strerror(errno), 0, MB_ICONERROR);
+  else {
+    static const export_format formats[] =
+      {EXPORT_TEXT, EXPORT_TEXT, EXPORT_ANSI, EXPORT_HTML};
+    term_export(fd, formats[min(ofn.nFilterIndex, lengthof(formats) - 1)]);
+  }
+}
 
 void
 win_copy(const wchar *data, uint *attrs, int len)
@@ -48,6 +48,12 @@ win_update_menus(void)
     clip ? "&Paste\tShift+Ins" : ct_sh ? "&Paste\tCtrl+Shift+V" : "&Paste"
   );
 
+  ModifyMenu(
+    menu, IDM_SEARCH, 0, IDM_SEARCH,
+    alt_fn ? "S&earch\tAlt+F3" : ct_sh ? "S&earch\tCtrl+Shift+H" : "S&earch"
+  );
+  EnableMenuItem(menu, IDM_EXPORT, term_exporting() ? MF_GRAYED : MF_ENABLED);
+
   ModifyMenu(
     menu, IDM_RESET, 0, IDM_RESET,
     alt_fn ? "&Reset\tAlt+F8" : ct_sh ? "&Reset\tCtrl+Shift+R" : "&Reset" 
@@ -90,6 +96,8 @@ win_init_menus(void)
   AppendMenu(menu, MF_ENABLED, IDM_COPY, 0);
   AppendMenu(menu, MF_ENABLED, IDM_PASTE, 0);
   AppendMenu(menu, MF_ENABLED, IDM_SELALL, "Select &All");
+  AppendMenu(menu, MF_ENABLED, IDM_SEARCH, 0);
+  AppendMenu(menu, MF_ENABLED, IDM_EXPORT, "E&xport...");
   AppendMenu(menu, MF_SEPARATOR, 0, 0);
   AppendMenu(menu, MF_ENABLED, IDM_RESET, 0);
   AppendMenu(menu, MF_SEPARATOR, 0, 0);
@@ -397,6 +405,7 @@ win_key_down(WPARAM wp, LPARAM lp)
       if (!ctrl) {
         switch (key) {
           when VK_F2:  send_syscommand(IDM_NEW);
+          when VK_F3:  send_syscommand(IDM_SEARCH);
           when VK_F4:  send_syscommand(SC_CLOSE);
           when VK_F8:  send_syscommand(IDM_RESET);
           when VK_F10: send_syscommand(IDM_DEFSIZE);
@@ -414,6 +423,7 @@ win_key_down(WPARAM wp, LPARAM lp)
         when 'C': term_copy();
         when 'V': win_paste();
         when 'N': send_syscommand(IDM_NEW);
+        when 'H': send_syscommand(IDM_SEARCH);
         when 'W': send_syscommand(SC_CLOSE);
         when 'R': send_syscommand(IDM_RESET);
         when 'D': send_syscommand(IDM_DEFSIZE);
@@ -480,6 +480,10 @@ win_reconfig(void)
     child_write(cs_ambig_wide ? "\e[2W" : "\e[1W", 4);
 }
 
+static void
+save_session(void)
+{ term_save_session(cfg.session_file); }
+
 static bool
 confirm_exit(void)
 {
@@ -513,11 +517,19 @@ win_proc(HWND wnd, UINT message, WPARAM wp, LPARAM lp)
         child_kill((GetKeyState(VK_SHIFT) & 0x80) != 0);
       return 0;
     when WM_COMMAND or WM_SYSCOMMAND:
+      if (message == WM_COMMAND && lp) {
+        // Notification from the search bar, the only control.
+        if (HIWORD(wp) == EN_CHANGE)
+          win_search_changed();
+        return 0;
+      }
       switch (wp & ~0xF) {  /* low 4 bits reserved to Windows */
         when IDM_OPEN: term_open();
         when IDM_COPY: term_copy();
         when IDM_PASTE: win_paste();
         when IDM_SELALL: term_select_all(); win_update();
+        when IDM_SEARCH: win_open_search();
+        when IDM_EXPORT: win_export();
         when IDM_RESET: term_reset(); win_update();
         when IDM_DEFSIZE: default_size();
         when IDM_FULLSCREEN: win_maximise(win_is_fullscreen ? 0 : 2);
@@ -630,7 +642,9 @@ win_proc(HWND wnd, UINT message, WPARAM wp, LPARAM lp)
       else if (wp == WMSZ_LEFT)
         r->left += ew;
       
-      win_show_tip(r->left + extra_width, r->top + extra_height, cols, rows);
+      char size[32];
+      sprintf(size, "%dx%d", cols, rows);
+      win_show_tip(r->left + extra_width, r->top + extra_height, size);
       
       return ew || eh;
     }
@@ -644,6 +658,7 @@ win_proc(HWND wnd, UINT message, WPARAM wp, LPARAM lp)
       
       if (!resizing)
         win_adapt_term_size();
+      win_place_search();
 
       return 0;
     }
@@ -978,7 +993,8 @@ main(int argc, char *argv[])
   // Create initial window.
   wnd = CreateWindowExW(cfg.scrollbar < 0 ? WS_EX_LEFTSCROLLBAR : 0,
                         wclass, wtitle,
-                        WS_OVERLAPPEDWINDOW | (cfg.scrollbar ? WS_VSCROLL : 0),
+                        WS_OVERLAPPEDWINDOW | WS_CLIPCHILDREN |
+                        (cfg.scrollbar ? WS_VSCROLL : 0),
                         cfg.x, cfg.y, width, height,
                         null, null, inst, null);
 
@@ -1008,6 +1024,12 @@ main(int argc, char *argv[])
   term_reset();
   term_resize(cfg.rows, cfg.cols);
 
+  // Restore the previous session's scrollback, and save it when exiting.
+  if (*cfg.session_file) {
+    term_load_session(cfg.session_file);
+    atexit(save_session);
+  }
+
   // Initialise the scroll bar.
   SetScrollInfo(
     wnd, SB_VERT,
@@ -30,7 +30,7 @@ void win_adapt_term_size(void);
 
 void win_open_config(void);
 
-void win_show_tip(int x, int y, int cols, int rows);
+void win_show_tip(int x, int y, char *text);
 void win_destroy_tip(void);
 
 void win_init_menus(void);
@@ -53,6 +53,14 @@ void win_switch(bool back);
 
 void win_set_ime_open(bool);
 
+void win_open_search(void);
+void win_close_search(void);
+void win_place_search(void);
+void win_search_changed(void);
+bool win_search_visible(void);
+
+void win_export(void);
+
 bool win_is_fullscreen;
 
 #endif
@@ -0,0 +1,106 @@
+// winsearch.c (part of mintty)
+// Licensed under the terms of the GNU General Public License v3 or later.
+
+#include "winpriv.h"
+
+/*
+ * The search bar is an edit control in the top right corner of the
+ * window. The terminal is searched as the text in it changes. Enter and
+ * Shift+Enter go to the next and previous match, and Escape closes the
+ * search bar. Ctrl+Enter instead treats the text as a regular expression
+ * and searches the whole scrollback for it in one go.
+ */
+
+static HWND search_wnd;
+static WNDPROC edit_proc;
+static bool regex_done;  // Regex search has been run for the current text
+
+static LRESULT CALLBACK
+search_proc(HWND ctl, UINT message, WPARAM wp, LPARAM lp)
+{
+  switch (message) {
+    when WM_KEYDOWN:
+      switch (wp) {
+        when VK_RETURN:
+          if ((GetKeyState(VK_CONTROL) & 0x80) && !regex_done) {
+            int len = GetWindowTextLengthW(search_wnd);
+            wchar text[len + 1];
+            GetWindowTextW(search_wnd, text, len + 1);
+            regex_done = true;
+            if (term_search_regex(text) < 0) {
+              MessageBeep(MB_ICONEXCLAMATION);
+              return 0;
+            }
+          }
+          term_search_next(GetKeyState(VK_SHIFT) & 0x80);
+          win_update();
+          return 0;
+        when VK_ESCAPE:
+          win_close_search();
+          return 0;
+      }
+    when WM_CHAR:
+      // Don't let the edit control beep about these.
+      if (wp == '\r' || wp == '\n' || wp == '\e')
+        return 0;
+  }
+  return CallWindowProcW(edit_proc, ctl, message, wp, lp);
+}
+
+bool
+win_search_visible(void)
+{ return search_wnd && IsWindowVisible(search_wnd); }
+
+void
+win_place_search(void)
+{
+  if (!win_search_visible())
+    return;
+  RECT cr;
+  GetClientRect(wnd, &cr);
+  int width = min(30 * font_width, cr.right);
+  SetWindowPos(search_wnd, HWND_TOP, cr.right - width, 0,
+               width, font_height + 6, SWP_NOACTIVATE);
+}
+
+void
+win_open_search(void)
+{
+  if (!search_wnd) {
+    search_wnd =
+      CreateWindowExW(WS_EX_CLIENTEDGE, L"EDIT", L"", WS_CHILD | ES_AUTOHSCROLL,
+                      0, 0, 0, 0, wnd, null, inst, null);
+    SendMessage(search_wnd, WM_SETFONT,
+                (WPARAM)GetStockObject(DEFAULT_GUI_FONT), false);
+    edit_proc = (WNDPROC)
+      SetWindowLongPtrW(search_wnd, GWLP_WNDPROC, (LONG_PTR)search_proc);
+  }
+  ShowWindow(search_wnd, SW_SHOW);
+  win_place_search();
+  SendMessage(search_wnd, EM_SETSEL, 0, -1);
+  SetFocus(search_wnd);
+  win_search_changed();
+}
+
+void
+win_close_search(void)
+{
+  if (!win_search_visible())
+    return;
+  ShowWindow(search_wnd, SW_HIDE);
+  SetFocus(wnd);
+  term_set_search(null);
+  win_update();
+}
+
+/* Called when the text in the search bar has changed. */
+void
+win_search_changed(void)
+{
+  int len = GetWindowTextLengthW(search_wnd);
+  wchar text[len + 1];
+  GetWindowTextW(search_wnd, text, len + 1);
+  regex_done = false;
+  term_set_search(text);
+  win_update();
+}
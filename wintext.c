@@ -319,13 +319,16 @@ win_zoom_font(int zoom)
 
 static HDC dc;
 static enum { UPDATE_IDLE, UPDATE_BLOCKED, UPDATE_PENDING } update_state;
+static bool local_update;  // update asked for by something other than output
 static bool ime_open;
+static bool in_paint;
 
 void
 win_paint(void)
 {
   PAINTSTRUCT p;
   dc = BeginPaint(wnd, &p);
+  in_paint = true;
 
   term_invalidate(
     (p.rcPaint.left - PADDING) / font_width,
@@ -359,9 +362,49 @@ win_paint(void)
     DeleteObject(SelectObject(dc, oldpen));
   }
   
+  in_paint = false;
   EndPaint(wnd, &p);
 }
 
+/*
+ * Move the contents of terminal rows `top' up to (but excluding) `bot' up
+ * by the given number of lines, or down if negative. The rows that are
+ * uncovered are left for the caller to draw. Returns false if scrolling
+ * isn't possible. That is the case while handling WM_PAINT, because
+ * drawing is clipped to the area being repainted then, and while a repaint
+ * is pending, because the area it covers doesn't move along.
+ */
+bool
+win_scroll(int top, int bot, int lines)
+{
+  if (in_paint || win_search_visible() || GetUpdateRect(wnd, null, false))
+    return false;
+
+  RECT r = {
+    .left = PADDING, .right = PADDING + term.cols * font_width,
+    .top = PADDING + top * font_height, .bottom = PADDING + bot * font_height
+  };
+  HRGN update_rgn = CreateRectRgn(0, 0, 0, 0);
+  ScrollWindowEx(wnd, 0, -lines * font_height, &r, &r, update_rgn, null, 0);
+
+ /*
+  * The update region contains the uncovered rows, which the caller is
+  * going to draw, plus anything that was scrolled in from parts of the
+  * window that are obscured. The latter needs a proper repaint.
+  */
+  RECT uncovered = r;
+  if (lines > 0)
+    uncovered.top = r.bottom - lines * font_height;
+  else
+    uncovered.bottom = r.top - lines * font_height;
+  HRGN uncovered_rgn = CreateRectRgnIndirect(&uncovered);
+  if (CombineRgn(update_rgn, update_rgn, uncovered_rgn, RGN_DIFF) != NULLREGION)
+    InvalidateRgn(wnd, update_rgn, false);
+  DeleteObject(uncovered_rgn);
+  DeleteObject(update_rgn);
+  return true;
+}
+
 static void
 do_update(void)
 {
@@ -370,7 +413,18 @@ do_update(void)
     return;
   }
 
+  // Hold back the paint while the application is drawing a frame in
+  // synchronized output mode, checking again on the usual schedule.
+  // Updates for the user's own actions still go through.
+  if (term.sync_output && !local_update &&
+      term.sync_output_end - get_tick_count() > 0) {
+    update_state = UPDATE_PENDING;
+    win_set_timer(do_update, 16);
+    return;
+  }
+
   update_state = UPDATE_BLOCKED;
+  local_update = false;
 
   dc = GetDC(wnd);
   term_paint();
@@ -411,6 +465,7 @@ do_update(void)
 void
 win_update(void)
 {
+  local_update = true;
   if (update_state == UPDATE_IDLE)
     do_update();
   else
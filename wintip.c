@@ -65,7 +65,7 @@ tip_proc(HWND hWnd, UINT nMsg, WPARAM wParam, LPARAM lParam)
 }
 
 void
-win_show_tip(int x, int y, int cols, int rows)
+win_show_tip(int x, int y, char *text)
 {
   if (!tip_wnd) {
     NONCLIENTMETRICS nci;
@@ -105,9 +105,7 @@ win_show_tip(int x, int y, int cols, int rows)
                    SWP_NOZORDER | SWP_NOSIZE | SWP_NOACTIVATE);
   }
 
-  char str[32];
-  sprintf(str, "%dx%d", cols, rows);
-  SetWindowText(tip_wnd, str);
+  SetWindowText(tip_wnd, text);
 }
 
 void
@@ -118,3 +116,22 @@ win_destroy_tip(void)
     tip_wnd = null;
   }
 }
+
+/*
+ * Show how far a background task such as exporting the scrollback has
+ * got, in the top left corner of the window, or hide it again with a
+ * negative percentage.
+ */
+void
+win_show_progress(int percent)
+{
+  if (percent < 0) {
+    win_destroy_tip();
+    return;
+  }
+  POINT p = {0, 0};
+  ClientToScreen(wnd, &p);
+  char text[32];
+  sprintf(text, "Exporting: %d%%", percent);
+  win_show_tip(p.x, p.y, text);
+}